@@ -13,19 +13,23 @@
 static std::unique_ptr<std::istream>
 OpenDataFileForReadStupidWindowsHack(const std::string& path);
 
+bool IO::IsLegalDataPath(const std::string& path) {
+  for(auto it = path.begin(); it != path.end(); ++it) {
+    if(*it == '.' && (it == path.begin() || it[-1] == '/'
+                      || it[-1] == *DIR_SEP))
+      return false;
+  }
+  return true;
+}
+
+static void check_data_path(const std::string& path) {
+  if(!IO::IsLegalDataPath(path))
+    die("Attempt to access an illegal datafile path: %s", path.c_str());
+}
+
 std::unique_ptr<std::istream>
 IO::OpenDataFileForRead(const std::string& path) {
-  std::string massaged_path(path);
-  auto it = massaged_path.begin();
-  while(it != massaged_path.end()) {
-    if(*it == '.' && (it == path.begin() || it[-1] == '/'))
-      die("Attempt to access an illegal datafile path: %s", path.c_str());
-    else if(*DIR_SEP != '/') {
-      if(*it == '/') *it = *DIR_SEP;
-      else if(*it == *DIR_SEP) *it = '/';
-    }
-    ++it;
-  }
+  check_data_path(path);
   return OpenDataFileForReadStupidWindowsHack(path);
 }
 
@@ -385,6 +389,25 @@ OpenDataFileForReadStupidWindowsHack(const std::string& filename) {
   return ret;
 }
 
+std::string IO::GetDataFilePath(const std::string& filename) {
+  check_data_path(filename);
+#if __WIN32__ && _UNICODE
+  TCHAR* tpath = get_data_path(filename.c_str());
+  char* path;
+  int string_length = WideCharToMultiByte(CP_UTF8, 0, tpath, -1, NULL, 0,
+                                          NULL, NULL);
+  path = reinterpret_cast<char*>(safe_malloc(string_length));
+  WideCharToMultiByte(CP_UTF8, 0, tpath, -1, path, string_length,
+                      NULL, NULL);
+  safe_free(tpath);
+#else
+  char* path = get_data_path(filename.c_str());
+#endif
+  std::string ret(path);
+  safe_free(path);
+  return ret;
+}
+
 static TCHAR* get_raw_path(const char* in_path) {
   TCHAR* path;
 #if __WIN32__ && _UNICODE
@@ -22,8 +22,17 @@ namespace IO {
   std::unique_ptr<std::iostream>
   OpenRawPathForUpdate(const std::string& path, bool log_error = true);
   /* Use this to read data files; FS virtualization may be in effect
-     Always prints an error on failure */
+     Always prints an error on failure
+     DIES if the path is illegal (see IsLegalDataPath) */
   std::unique_ptr<std::istream> OpenDataFileForRead(const std::string& path);
+  /* Returns a UTF-8 absolute path to the data file OpenDataFileForRead would
+     open, for things that need a real file (like Net::FileSender).
+     Doesn't check that it exists, but DIES if the path is illegal. */
+  std::string GetDataFilePath(const std::string& path);
+  /* false if any component of path starts with a dot (so no "..", and no
+     hidden files); check this first if the path came from somewhere you
+     don't trust, such as the network */
+  bool IsLegalDataPath(const std::string& path);
   /* Use these to read/write configuration files
      Sequence for writing a config file:
      OpenConfigFileForWrite, (write stuff), fclose, UpdateConfigFile
@@ -0,0 +1,118 @@
+#include "netaccept.hh"
+
+#if !__WIN32__
+# include <errno.h>
+# include <fcntl.h>
+# define HAVE_RESERVE_FD 1
+#endif
+
+using namespace Net;
+
+#if HAVE_RESERVE_FD
+static int open_reserve() {
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+#endif
+
+Acceptor::Acceptor(size_t batch_size)
+  : socks(new SockStream[batch_size]), addresses(new Address[batch_size]),
+    batch_size(batch_size), reserve_fd(-1) {
+  assert(batch_size > 0);
+#if HAVE_RESERVE_FD
+  reserve_fd = open_reserve();
+#endif
+  ResetStats();
+}
+
+Acceptor::~Acceptor() {
+#if HAVE_RESERVE_FD
+  if(reserve_fd >= 0) close(reserve_fd);
+#endif
+}
+
+bool Acceptor::Bind(std::string& error_out, const char* bind_address,
+                    uint16_t port, IPVersion v, int backlog,
+                    bool reuse_port) {
+  return sock.Bind(error_out, bind_address, port, v, backlog, reuse_port);
+}
+
+size_t Acceptor::Drain(const Callback& callback, size_t max_count) {
+  size_t ret = 0;
+#if HAVE_RESERVE_FD
+  size_t shed = 0;
+#endif
+  ++stats.drains;
+  while(ret < max_count) {
+    size_t want = max_count - ret;
+    if(want > batch_size) want = batch_size;
+    int err;
+    size_t aborted;
+    size_t count = sock.AcceptBatch(socks.get(), addresses.get(), want,
+                                    &err, &aborted);
+    stats.aborted += aborted;
+    for(size_t n = 0; n < count; ++n) {
+      callback(socks[n], addresses[n]);
+      /* in case the callback didn't take it */
+      socks[n].Close();
+    }
+    ret += count;
+#if HAVE_RESERVE_FD
+    /* shed counts against max_count too, so this can't go on forever */
+    if((err == EMFILE || err == ENFILE) && ret + shed < max_count
+       && reserve_fd >= 0) {
+      if(Shed(err)) {
+        ++shed;
+        continue;
+      }
+      /* Linux wants a free descriptor before it looks at the backlog, so
+         this may have been nothing at all, in which case err is now 0 */
+    }
+#endif
+    if(err) {
+      ++stats.errors;
+      stats.last_error = err;
+      break;
+    }
+    /* a short batch means the backlog is empty */
+    if(count < want) break;
+  }
+  stats.accepted += ret;
+  if(ret == 0) ++stats.empty_drains;
+  if(ret > stats.largest_drain) stats.largest_drain = ret;
+  return ret;
+}
+
+/* Makes room to accept the connection we had no file descriptor for, and
+   throws it away. Returns false if nothing was shed; err_out is the error
+   from that attempt, if any. */
+bool Acceptor::Shed(int& err_out) {
+#if HAVE_RESERVE_FD
+  close(reserve_fd);
+  size_t aborted;
+  size_t count = sock.AcceptBatch(socks.get(), addresses.get(), 1, &err_out,
+                                  &aborted);
+  stats.aborted += aborted;
+  socks[0].Close();
+  reserve_fd = open_reserve();
+  stats.shed += count;
+  return count > 0;
+#else
+  (void)err_out;
+  return false;
+#endif
+}
+
+void Acceptor::ResetStats() {
+  stats.accepted = 0;
+  stats.drains = 0;
+  stats.empty_drains = 0;
+  stats.largest_drain = 0;
+  stats.aborted = 0;
+  stats.shed = 0;
+  stats.errors = 0;
+  stats.last_error = 0;
+}
+
+void Acceptor::Close() {
+  sock.Close();
+}
@@ -0,0 +1,82 @@
+#ifndef NETACCEPTHH
+#define NETACCEPTHH
+
+#include "netsock.hh"
+
+#include <functional>
+
+namespace Net {
+  /*
+    A listening ServerSockStream that, whenever it's readable, accepts every
+    connection that's waiting instead of just one, so a burst of connections
+    costs one trip through the Poller rather than one per connection. On
+    Linux, each connection costs exactly one system call (accept4 makes it
+    non-blocking and close-on-exec, and it inherits TCP_NODELAY from the
+    listening socket).
+    Keeps counters, so you can tell how fast connections are arriving and
+    whether the backlog is keeping up. For a rate, sample GetStats().accepted
+    twice and divide by the time in between.
+    Keeps one spare file descriptor in reserve (except on Windows). If we
+    run out, a connection that can't be accepted would stay in the backlog
+    and keep the listener readable, so the Poller would spin; instead, the
+    reserve is closed long enough to accept that connection and close it
+    right away. The client sees the connection reset.
+  */
+  class Acceptor {
+  public:
+    /* the kernel silently caps this (on Linux, at net.core.somaxconn) */
+    static const int DEFAULT_BACKLOG = 4096;
+    struct Stats {
+      /* connections accepted */
+      uint64_t accepted;
+      /* calls to Drain, and how many of those found nothing waiting */
+      uint64_t drains, empty_drains;
+      /* the most connections accepted by one Drain */
+      uint64_t largest_drain;
+      /* connections that were reset before we got around to them */
+      uint64_t aborted;
+      /* connections accepted and closed straight away, because we were out
+         of file descriptors */
+      uint64_t shed;
+      /* times Drain had to stop early because of an error; the rest stay in
+         the backlog */
+      uint64_t errors;
+      /* the last such error, as an errno (or WSA error) value */
+      int last_error;
+    };
+    /* Called for each new connection; move the SockStream somewhere if you
+       want to keep it. */
+    typedef std::function<void(SockStream& sock, const Address& address)>
+    Callback;
+  private:
+    ServerSockStream sock;
+    std::unique_ptr<SockStream[]> socks;
+    std::unique_ptr<Address[]> addresses;
+    size_t batch_size;
+    /* see above; -1 if we don't have one */
+    int reserve_fd;
+    Stats stats;
+    bool Shed(int& err_out);
+    Acceptor(const Acceptor&) = delete;
+    Acceptor& operator=(const Acceptor&) = delete;
+  public:
+    /* batch_size is how many connections are accepted between callbacks;
+       it doesn't limit how many Drain accepts */
+    explicit Acceptor(size_t batch_size = 64);
+    ~Acceptor();
+    bool Bind(std::string& error_out, const char* bind_address,
+              uint16_t port, IPVersion v, int backlog = DEFAULT_BACKLOG,
+              bool reuse_port = false);
+    /* Accepts connections until there are none left (or max_count have been
+       accepted), calling the callback for each. Call this whenever GetSock()
+       is readable. Returns how many were accepted. */
+    size_t Drain(const Callback& callback, size_t max_count = ~(size_t)0);
+    /* for registering with a Poller */
+    inline ServerSockStream& GetSock() { return sock; }
+    inline const Stats& GetStats() const { return stats; }
+    void ResetStats();
+    void Close();
+  };
+}
+
+#endif
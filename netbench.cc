@@ -0,0 +1,403 @@
+/*
+  Loopback benchmarks for netsock and friends. Not part of libteg.a; see the
+  bin/netbench target in teg.mk.
+
+  usage: netbench [-q] [scenario ...]
+  -q runs fewer iterations (for CI). With no scenarios, runs them all.
+
+  Prints one JSON object per line to stdout for each result, and progress
+  to stderr. Exits nonzero if any scenario couldn't be set up.
+*/
+
+#include "netsock.hh"
+#include "netaccept.hh"
+
+#include <algorithm>
+#if !__WIN32__
+#include <sys/resource.h>
+#endif
+
+using namespace Net;
+
+namespace {
+  bool quick = false;
+  bool any_failed = false;
+
+  uint64_t now_ns() { return LatencyHistogram::Now(); }
+
+  /* Writes one result line. fields is a list of already-formatted
+     "name":value pairs, without the braces. */
+  void report(const char* scenario, const std::string& fields) {
+    printf("{\"scenario\":\"%s\",%s}\n", scenario, fields.c_str());
+    fflush(stdout);
+  }
+
+  void report_error(const char* scenario, const std::string& error) {
+    std::string escaped;
+    for(char c : error) {
+      if(c == '"' || c == '\\') escaped += '\\';
+      if((unsigned char)c >= 0x20) escaped += c;
+    }
+    printf("{\"scenario\":\"%s\",\"error\":\"%s\"}\n", scenario,
+           escaped.c_str());
+    fflush(stdout);
+    fprintf(stderr, "%s: %s\n", scenario, error.c_str());
+    any_failed = true;
+  }
+
+  std::string field(const char* name, uint64_t value) {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "\"%s\":%llu", name,
+             (unsigned long long)value);
+    return buf;
+  }
+
+  std::string field(const char* name, double value) {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "\"%s\":%.3f", name, value);
+    return buf;
+  }
+
+  std::string join(std::initializer_list<std::string> fields) {
+    std::string ret;
+    for(auto& f : fields) {
+      if(!ret.empty()) ret += ',';
+      ret += f;
+    }
+    return ret;
+  }
+
+  /* a bound ServerSockDgram on 127.0.0.1, and where to find it */
+  bool make_udp_server(std::string& error_out, ServerSockDgram& server,
+                       Address& address_out) {
+    if(!server.Bind(error_out, "127.0.0.1", 0, IPVersion::V4))
+      return false;
+    if(!server.GetSockName(address_out)) {
+      error_out = "getsockname failed";
+      return false;
+    }
+    return true;
+  }
+
+  /* waits until sock is readable (or a second passes) */
+  bool wait_readable(Poller& poller) {
+    return !poller.Wait(1000000).empty();
+  }
+
+  void udp_pingpong() {
+    const char* name = "udp_pingpong";
+    fprintf(stderr, "%s...\n", name);
+    std::string error;
+    ServerSockDgram server;
+    Address server_address;
+    SockDgram client;
+    if(!make_udp_server(error, server, server_address)
+       || client.Connect(error, server_address) != IOResult::OKAY)
+      return report_error(name, error);
+    Poller server_poller, client_poller;
+    if(!server_poller.Register(error, server, true, false)
+       || !client_poller.Register(error, client, true, false))
+      return report_error(name, error);
+    const size_t iterations = quick ? 2000 : 20000;
+    const size_t warmup = 100;
+    std::vector<uint64_t> samples;
+    samples.reserve(iterations);
+    uint8_t buf[64] = {};
+    for(size_t n = 0; n < iterations + warmup; ++n) {
+      ErrorCode ec;
+      uint64_t start = now_ns();
+      if(client.Send(ec, buf, sizeof(buf)) != IOResult::OKAY
+         || !wait_readable(server_poller))
+        return report_error(name, "ping lost");
+      size_t len = sizeof(buf);
+      Address from;
+      if(server.Receive(ec, buf, len, from) != IOResult::OKAY
+         || server.Send(ec, buf, len, from) != IOResult::OKAY
+         || !wait_readable(client_poller))
+        return report_error(name, "pong lost");
+      len = sizeof(buf);
+      if(client.Receive(ec, buf, len) != IOResult::OKAY)
+        return report_error(name, "pong lost");
+      if(n >= warmup) samples.push_back(now_ns() - start);
+    }
+    std::sort(samples.begin(), samples.end());
+    uint64_t total = 0;
+    for(auto sample : samples) total += sample;
+    report(name, join({field("iterations", (uint64_t)iterations),
+            field("mean_ns", total / samples.size()),
+            field("p50_ns", samples[samples.size() / 2]),
+            field("p99_ns", samples[samples.size() * 99 / 100]),
+            field("max_ns", samples.back())}));
+  }
+
+  void udp_flood() {
+    const char* name = "udp_flood";
+    fprintf(stderr, "%s...\n", name);
+    std::string error;
+    ServerSockDgram server;
+    Address server_address;
+    if(!make_udp_server(error, server, server_address))
+      return report_error(name, error);
+    const size_t num_clients = 64;
+    const size_t burst = 16;
+    const size_t packet_size = 1200;
+    std::vector<SockDgram> clients(num_clients);
+    for(auto& client : clients)
+      if(client.Connect(error, server_address) != IOResult::OKAY)
+        return report_error(name, error);
+    const size_t batch = 64;
+    std::vector<uint8_t> storage(batch * packet_size);
+    DgramSlot slots[batch];
+    uint8_t packet[packet_size] = {};
+    uint64_t sent = 0, send_blocked = 0, received = 0, bytes = 0;
+    ErrorCode ec;
+    /* takes everything that's waiting; false on an error */
+    auto drain = [&]() -> bool {
+      while(true) {
+        for(size_t n = 0; n < batch; ++n) {
+          slots[n].buf = storage.data() + n * packet_size;
+          slots[n].len = packet_size;
+        }
+        size_t count = batch;
+        IOResult result = server.ReceiveBatch(ec, slots, count);
+        if(result == IOResult::WOULD_BLOCK) return true;
+        else if(result != IOResult::OKAY) return false;
+        received += count;
+        for(size_t n = 0; n < count; ++n) bytes += slots[n].len;
+        if(count < batch) return true;
+      }
+    };
+    const uint64_t duration = quick ? 200000000 : 1000000000;
+    uint64_t start = now_ns(), end = start + duration, finish;
+    while((finish = now_ns()) < end) {
+      /* drain whenever there's a full batch in flight; everyone's bursts
+         at once would overflow the server's receive buffer, and then we'd
+         be measuring its size instead of ReceiveBatch */
+      for(size_t c = 0; c < num_clients; ++c) {
+        SockDgram& client = clients[c];
+        for(size_t n = 0; n < burst; ++n) {
+          IOResult result = client.Send(ec, packet, packet_size);
+          if(result == IOResult::OKAY) ++sent;
+          else if(result == IOResult::WOULD_BLOCK) {
+            ++send_blocked;
+            break;
+          }
+          else return report_error(name, ec.ToString());
+        }
+        if((c + 1) % (batch / burst) == 0 && !drain())
+          return report_error(name, ec.ToString());
+      }
+    }
+    double seconds = (finish - start) / 1e9;
+    /* anything still in flight isn't a drop */
+    if(!drain()) return report_error(name, ec.ToString());
+    uint64_t dropped = sent > received ? sent - received : 0;
+    report(name, join({field("sockets", (uint64_t)num_clients),
+            field("packet_size", (uint64_t)packet_size),
+            field("sent", sent), field("received", received),
+            field("dropped", dropped),
+            field("send_would_block", send_blocked),
+            field("sent_pps", sent / seconds),
+            field("received_pps", received / seconds),
+            field("received_mbit_per_s", bytes * 8 / seconds / 1e6),
+            field("loss", sent ? (double)dropped / sent : 0.0)}));
+  }
+
+  /* a connected pair of SockStreams over loopback */
+  bool make_tcp_pair(std::string& error_out, SockStream& client,
+                     SockStream& server) {
+    ServerSockStream listener;
+    Address address;
+    if(!listener.Bind(error_out, "127.0.0.1", 0, IPVersion::V4))
+      return false;
+    if(!listener.GetSockName(address)) {
+      error_out = "getsockname failed";
+      return false;
+    }
+    IOResult result = client.Connect(error_out, address);
+    if(result != IOResult::OKAY && result != IOResult::WOULD_BLOCK)
+      return false;
+    Poller poller;
+    if(!poller.Register(error_out, listener, true, false)) return false;
+    if(!wait_readable(poller) || !listener.Accept(server, address)) {
+      error_out = "accept failed";
+      return false;
+    }
+    return true;
+  }
+
+  void tcp_bulk() {
+    const char* name = "tcp_bulk";
+    fprintf(stderr, "%s...\n", name);
+    std::string error;
+    SockStream client, server;
+    if(!make_tcp_pair(error, client, server))
+      return report_error(name, error);
+    const uint64_t total = quick ? (64ULL << 20) : (512ULL << 20);
+    const size_t chunk = 65536;
+    std::vector<uint8_t> send_buf(chunk), receive_buf(chunk);
+    uint64_t sent = 0, received = 0;
+    uint64_t start = now_ns();
+    while(received < total) {
+      while(sent < total) {
+        size_t len = total - sent < chunk ? total - sent : chunk;
+        ErrorCode ec;
+        IOResult result = client.Send(ec, send_buf.data(), len);
+        if(result == IOResult::WOULD_BLOCK) break;
+        else if(result != IOResult::OKAY)
+          return report_error(name, ec.ToString());
+        sent += len;
+      }
+      while(true) {
+        size_t len = chunk;
+        ErrorCode ec;
+        IOResult result = server.Receive(ec, receive_buf.data(), len);
+        if(result == IOResult::WOULD_BLOCK) break;
+        else if(result != IOResult::OKAY)
+          return report_error(name, ec.ToString());
+        received += len;
+      }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    report(name, join({field("bytes", total),
+            field("mbyte_per_s", total / seconds / 1048576.0)}));
+  }
+
+  void select_scaling() {
+    const char* name = "select_scaling";
+    for(size_t count : {10, 100, 1000}) {
+      fprintf(stderr, "%s (%zu)...\n", name, count);
+      std::string error;
+      std::vector<SockDgram> socks(count);
+      std::forward_list<SockDgram*> list;
+      Poller poller;
+      for(auto& sock : socks) {
+        if(sock.MakeLoop(error) != IOResult::OKAY
+           || !poller.Register(error, sock, true, false))
+          return report_error(name, error);
+        list.push_front(&sock);
+      }
+      /* exactly one of them is readable */
+      ErrorCode ec;
+      if(socks.back().Send(ec, "x", 1) != IOResult::OKAY)
+        return report_error(name, ec.ToString());
+      size_t iterations = (quick ? 20000 : 200000) / count;
+      if(iterations < 100) iterations = 100;
+      uint64_t start = now_ns();
+      for(size_t n = 0; n < iterations; ++n) {
+        Select select(nullptr, nullptr, nullptr, nullptr, nullptr,
+                      &list, nullptr, 0);
+        if(select.GetReadableSockDgrams().empty())
+          return report_error(name, "Select missed the readable socket");
+      }
+      uint64_t select_ns = (now_ns() - start) / iterations;
+      start = now_ns();
+      for(size_t n = 0; n < iterations; ++n) {
+        if(poller.Wait(0).size() != 1)
+          return report_error(name, "Poller missed the readable socket");
+      }
+      uint64_t poller_ns = (now_ns() - start) / iterations;
+      report(name, join({field("sockets", (uint64_t)count),
+              field("iterations", (uint64_t)iterations),
+              field("select_ns", select_ns),
+              field("poller_ns", poller_ns),
+              "\"poller_epoll\":" + std::string(poller.IsPersistent()
+                                                ? "true" : "false")}));
+    }
+  }
+
+  /* batch: drain the whole backlog with an Acceptor per wakeup, rather
+     than one Accept per wakeup */
+  void accept_storm(bool batch) {
+    const char* name = batch ? "accept_storm_batch" : "accept_storm_single";
+    fprintf(stderr, "%s...\n", name);
+    std::string error;
+    Acceptor acceptor;
+    Address address;
+    if(!acceptor.Bind(error, "127.0.0.1", 0, IPVersion::V4))
+      return report_error(name, error);
+    if(!acceptor.GetSock().GetSockName(address))
+      return report_error(name, "getsockname failed");
+    Poller poller;
+    if(!poller.Register(error, acceptor.GetSock(), true, false))
+      return report_error(name, error);
+    const size_t per_round = 256;
+    const size_t rounds = quick ? 3 : 10;
+    uint64_t total_ns = 0, wakeups = 0;
+    for(size_t round = 0; round < rounds; ++round) {
+      std::vector<SockStream> clients(per_round), accepted;
+      accepted.reserve(per_round);
+      uint64_t start = now_ns();
+      for(auto& client : clients) {
+        IOResult result = client.Connect(error, address);
+        if(result != IOResult::OKAY && result != IOResult::WOULD_BLOCK)
+          return report_error(name, error);
+      }
+      while(accepted.size() < per_round) {
+        if(!wait_readable(poller))
+          return report_error(name, "connections went missing");
+        ++wakeups;
+        if(batch) {
+          acceptor.Drain([&](SockStream& sock, const Address&) {
+              accepted.emplace_back(std::move(sock));
+            });
+        }
+        else {
+          SockStream sock;
+          Address from;
+          if(acceptor.GetSock().Accept(sock, from))
+            accepted.emplace_back(std::move(sock));
+        }
+      }
+      total_ns += now_ns() - start;
+    }
+    double seconds = total_ns / 1e9;
+    report(name, join({field("connections", (uint64_t)(per_round * rounds)),
+            field("wakeups", wakeups),
+            field("connections_per_s", per_round * rounds / seconds)}));
+  }
+
+  struct Scenario {
+    const char* name;
+    void(*run)();
+  };
+  const Scenario scenarios[] = {
+    {"udp_pingpong", udp_pingpong},
+    {"udp_flood", udp_flood},
+    {"tcp_bulk", tcp_bulk},
+    {"select_scaling", select_scaling},
+    {"accept_storm", []() { accept_storm(false); accept_storm(true); }},
+  };
+}
+
+int teg_main(int argc, char* argv[]) {
+#if !__WIN32__
+  /* select_scaling needs a thousand sockets at once */
+  struct rlimit limit;
+  if(!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+#endif
+  std::vector<const Scenario*> selected;
+  for(int n = 1; n < argc; ++n) {
+    if(!strcmp(argv[n], "-q")) {
+      quick = true;
+      continue;
+    }
+    const Scenario* found = nullptr;
+    for(auto& scenario : scenarios)
+      if(!strcmp(argv[n], scenario.name)) found = &scenario;
+    if(!found) {
+      fprintf(stderr, "Unknown scenario: %s\nScenarios:", argv[n]);
+      for(auto& scenario : scenarios) fprintf(stderr, " %s", scenario.name);
+      fprintf(stderr, "\n");
+      return 2;
+    }
+    selected.push_back(found);
+  }
+  if(selected.empty())
+    for(auto& scenario : scenarios) selected.push_back(&scenario);
+  for(auto scenario : selected) scenario->run();
+  return any_failed ? 1 : 0;
+}
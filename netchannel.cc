@@ -0,0 +1,517 @@
+#include "netchannel.hh"
+
+using namespace Net;
+
+/* how many sent packets we remember, waiting for acks; must be more than
+   the 33 that a single ack can cover */
+#define SENT_PACKET_HISTORY 128
+/* initial, minimum and maximum retransmit timeouts */
+#define INITIAL_RTO_US 250000
+#define MIN_RTO_US 20000
+#define MAX_RTO_US 2000000
+/* set in a packet's flags if its ack fields mean anything */
+#define FLAG_HAS_ACK 1
+/* set if the rest of the packet is padding, to probe the path MTU */
+#define FLAG_PROBE 2
+
+namespace {
+  enum class SlotState : uint8_t {
+    FREE,
+    /* sending */ QUEUED, SENT, ACKED,
+    /* receiving */ READY, DELIVERED
+  };
+  struct SendSlot {
+    uint16_t id, len;
+    SlotState state;
+    uint64_t last_sent_us;
+  };
+  struct ReceiveSlot {
+    uint16_t id, len;
+    SlotState state;
+  };
+  /* true if sequence number a comes after b, allowing for wraparound */
+  inline bool seq_newer(uint16_t a, uint16_t b) { return (int16_t)(a - b) > 0; }
+  inline void put16(uint8_t* p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+  inline void put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+  }
+  inline uint16_t get16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+  inline uint32_t get32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+      | ((uint32_t)p[2] << 8) | p[3];
+  }
+}
+
+struct Connection::Channel {
+  ChannelMode mode;
+  /* Reliable: the messages in [send_base, send_next) are waiting to be
+     acked, in slot (id % window).
+     Sequenced: [send_base, send_next) is a queue of messages waiting to be
+     sent, in slot (id % window). */
+  std::unique_ptr<SendSlot[]> send_slots;
+  std::unique_ptr<uint8_t[]> send_data;
+  uint16_t send_base, send_next;
+  /* Ordered: receive_base is the next message to deliver; message id lives
+     in slot (id % window).
+     Unordered: receive_base is the oldest undelivered message; message id
+     lives in slot (id % window), and ready is a queue of message IDs, in the
+     order in which they arrived.
+     Sequenced: slots [receive_base, receive_base + ready_count) (mod window)
+     are a queue of messages; receive_last is the newest message that's
+     arrived. */
+  std::unique_ptr<ReceiveSlot[]> receive_slots;
+  std::unique_ptr<uint8_t[]> receive_data;
+  std::unique_ptr<uint16_t[]> ready;
+  /* Sequenced: send_base before the last BuildPacket */
+  uint16_t built_base;
+  uint16_t receive_base, receive_last;
+  size_t ready_head, ready_count;
+  bool have_received;
+  inline bool IsReliable() const {
+    return mode != ChannelMode::UNRELIABLE_SEQUENCED;
+  }
+};
+
+struct Connection::SentPacket {
+  uint16_t seq;
+  /* nonzero if this was a path MTU probe */
+  uint16_t probe_size;
+  bool in_flight;
+  uint8_t count;
+  uint64_t sent_us;
+  struct {
+    uint8_t channel;
+    uint16_t id;
+  } messages[MAX_MESSAGES_PER_PACKET];
+};
+
+Connection::Connection(const ChannelMode* modes, size_t num_channels,
+                       size_t mtu, size_t window, size_t max_mtu)
+  : channels(new Channel[num_channels]),
+    sent_packets(new SentPacket[SENT_PACKET_HISTORY]()),
+    num_channels(num_channels), window(window), mtu(mtu),
+    max_mtu(max_mtu > mtu ? max_mtu : mtu),
+    max_message_size(mtu - PACKET_HEADER_SIZE - MESSAGE_HEADER_SIZE),
+    slot_size(this->max_mtu - PACKET_HEADER_SIZE - MESSAGE_HEADER_SIZE),
+    pmtu(max_mtu > mtu ? new PathMTU(mtu, max_mtu) : nullptr),
+    packet_buf(new uint8_t[this->max_mtu]), next_packet_seq(0),
+    received_seq(0), received_bits(0),
+    have_received(false), ack_pending(false),
+    srtt_us(0), rttvar_us(0), rto_us(INITIAL_RTO_US),
+    backoff_us(~(uint64_t)0) {
+  assert(num_channels > 0 && num_channels <= 256);
+  assert(window > 0 && window <= 32768);
+  assert(mtu > PACKET_HEADER_SIZE + MESSAGE_HEADER_SIZE);
+  if(max_message_size > 65535) max_message_size = 65535;
+  if(slot_size > 65535) slot_size = 65535;
+  for(size_t n = 0; n < num_channels; ++n) {
+    Channel& channel = channels[n];
+    channel.mode = modes[n];
+    channel.send_slots.reset(new SendSlot[window]());
+    channel.send_data.reset(new uint8_t[window * slot_size]);
+    channel.send_base = channel.send_next = channel.built_base = 0;
+    channel.receive_slots.reset(new ReceiveSlot[window]());
+    channel.receive_data.reset(new uint8_t[window * slot_size]);
+    if(channel.mode == ChannelMode::UNORDERED_RELIABLE)
+      channel.ready.reset(new uint16_t[window]);
+    channel.receive_base = channel.receive_last = 0;
+    channel.ready_head = channel.ready_count = 0;
+    channel.have_received = false;
+  }
+}
+
+Connection::~Connection() {}
+
+bool Connection::Send(size_t index, const void* data, size_t len) {
+  if(index >= num_channels || len > max_message_size) return false;
+  Channel& channel = channels[index];
+  if((uint16_t)(channel.send_next - channel.send_base) >= window)
+    return false;
+  size_t n = channel.send_next % window;
+  SendSlot& slot = channel.send_slots[n];
+  slot.id = channel.send_next++;
+  slot.len = len;
+  slot.state = SlotState::QUEUED;
+  memcpy(channel.send_data.get() + n * slot_size, data, len);
+  return true;
+}
+
+void Connection::UpdateMTU() {
+  mtu = pmtu->GetMTU();
+  max_message_size = mtu - PACKET_HEADER_SIZE - MESSAGE_HEADER_SIZE;
+  if(max_message_size > slot_size) max_message_size = slot_size;
+}
+
+bool Connection::HandleMsgSize(size_t len, bool probe, uint64_t now_us) {
+  if(!pmtu || len <= pmtu->GetBaseMTU()) return false;
+  size_t old_mtu = mtu;
+  pmtu->HandleMsgSize(len, now_us);
+  UpdateMTU();
+  /* a lone message that's bigger than the MTU won't get any smaller */
+  return probe || mtu < old_mtu;
+}
+
+void Connection::Unbuild() {
+  uint16_t seq = --next_packet_seq;
+  SentPacket& record = sent_packets[seq % SENT_PACKET_HISTORY];
+  record.in_flight = false;
+  for(size_t n = 0; n < record.count; ++n) {
+    Channel& channel = channels[record.messages[n].channel];
+    SendSlot& slot = channel.send_slots[record.messages[n].id % window];
+    if(built_sent_us[n] == ~(uint64_t)0) slot.state = SlotState::QUEUED;
+    else slot.last_sent_us = built_sent_us[n];
+  }
+  for(size_t index = 0; index < num_channels; ++index) {
+    Channel& channel = channels[index];
+    if(channel.IsReliable()) continue;
+    /* their data is still in the slots */
+    while(channel.send_base != channel.built_base) {
+      --channel.send_base;
+      channel.send_slots[channel.send_base % window].state
+        = SlotState::QUEUED;
+    }
+  }
+  ack_pending = built_ack_pending;
+  rto_us = built_rto_us;
+  backoff_us = built_backoff_us;
+}
+
+size_t Connection::BuildPacket(void* buf, uint64_t now_us) {
+  uint8_t* const start = reinterpret_cast<uint8_t*>(buf);
+  uint8_t* p = start + PACKET_HEADER_SIZE;
+  uint8_t* end = start + mtu;
+  SentPacket& record = sent_packets[next_packet_seq % SENT_PACKET_HISTORY];
+  record.count = 0;
+  record.probe_size = 0;
+  built_ack_pending = ack_pending;
+  built_rto_us = rto_us;
+  built_backoff_us = backoff_us;
+  bool timed_out = false;
+  for(size_t index = 0; index < num_channels; ++index)
+    channels[index].built_base = channels[index].send_base;
+  bool any = false;
+  size_t probe_size = pmtu ? pmtu->GetProbeSize(now_us, rto_us * 2) : 0;
+  if(probe_size > 0) {
+    memset(p, 0, probe_size - PACKET_HEADER_SIZE);
+    p = start + probe_size;
+    record.probe_size = probe_size;
+    pmtu->ProbeSent(probe_size, now_us);
+    any = true;
+  }
+  else for(size_t index = 0; index < num_channels; ++index) {
+    Channel& channel = channels[index];
+    if(channel.IsReliable()) {
+      for(uint16_t id = channel.send_base; id != channel.send_next; ++id) {
+        if(record.count >= MAX_MESSAGES_PER_PACKET) break;
+        size_t n = id % window;
+        SendSlot& slot = channel.send_slots[n];
+        if(slot.state != SlotState::QUEUED
+           && !(slot.state == SlotState::SENT
+                && now_us - slot.last_sent_us >= rto_us))
+          continue;
+        if((size_t)(end - p) < MESSAGE_HEADER_SIZE + slot.len) {
+          /* the MTU shrank since this was queued; send it alone */
+          if(!any && slot.len > max_message_size)
+            end = p + MESSAGE_HEADER_SIZE + slot.len;
+          /* a smaller message later on might still fit */
+          else continue;
+        }
+        *p = index;
+        put16(p + 1, id);
+        put16(p + 3, slot.len);
+        memcpy(p + MESSAGE_HEADER_SIZE,
+               channel.send_data.get() + n * slot_size, slot.len);
+        p += MESSAGE_HEADER_SIZE + slot.len;
+        built_sent_us[record.count] = slot.state == SlotState::QUEUED
+          ? ~(uint64_t)0 : slot.last_sent_us;
+        if(slot.state == SlotState::SENT) timed_out = true;
+        slot.state = SlotState::SENT;
+        slot.last_sent_us = now_us;
+        record.messages[record.count].channel = index;
+        record.messages[record.count].id = id;
+        ++record.count;
+        any = true;
+      }
+    }
+    else {
+      while(channel.send_base != channel.send_next) {
+        size_t n = channel.send_base % window;
+        SendSlot& slot = channel.send_slots[n];
+        if((size_t)(end - p) < MESSAGE_HEADER_SIZE + slot.len) {
+          if(!any && slot.len > max_message_size)
+            end = p + MESSAGE_HEADER_SIZE + slot.len;
+          else break;
+        }
+        *p = index;
+        put16(p + 1, slot.id);
+        put16(p + 3, slot.len);
+        memcpy(p + MESSAGE_HEADER_SIZE,
+               channel.send_data.get() + n * slot_size, slot.len);
+        p += MESSAGE_HEADER_SIZE + slot.len;
+        slot.state = SlotState::FREE;
+        ++channel.send_base;
+        any = true;
+      }
+    }
+  }
+  if(!any && !ack_pending) return 0;
+  /* RFC 6298 section 5.5: back off */
+  if(timed_out && backoff_us != now_us) {
+    rto_us = rto_us * 2 < MAX_RTO_US ? rto_us * 2 : MAX_RTO_US;
+    backoff_us = now_us;
+  }
+  record.seq = next_packet_seq;
+  record.in_flight = true;
+  record.sent_us = now_us;
+  put16(start, next_packet_seq++);
+  put16(start + 2, received_seq);
+  put32(start + 4, received_bits);
+  start[8] = (have_received ? FLAG_HAS_ACK : 0)
+    | (record.probe_size ? FLAG_PROBE : 0);
+  ack_pending = false;
+  return p - start;
+}
+
+void Connection::HandleAck(uint16_t seq, uint64_t now_us) {
+  SentPacket& record = sent_packets[seq % SENT_PACKET_HISTORY];
+  if(!record.in_flight || record.seq != seq) return;
+  record.in_flight = false;
+  if(record.probe_size) {
+    pmtu->ProbeAcked(record.probe_size, now_us);
+    UpdateMTU();
+  }
+  /* RFC 6298 */
+  uint64_t sample = now_us - record.sent_us;
+  if(srtt_us == 0) {
+    srtt_us = sample > 0 ? sample : 1;
+    rttvar_us = sample / 2;
+  }
+  else {
+    uint64_t delta = sample > srtt_us ? sample - srtt_us : srtt_us - sample;
+    rttvar_us = (rttvar_us * 3 + delta) / 4;
+    srtt_us = (srtt_us * 7 + sample) / 8;
+    if(srtt_us == 0) srtt_us = 1;
+  }
+  rto_us = srtt_us + rttvar_us * 4;
+  if(rto_us < MIN_RTO_US) rto_us = MIN_RTO_US;
+  else if(rto_us > MAX_RTO_US) rto_us = MAX_RTO_US;
+  for(size_t n = 0; n < record.count; ++n) {
+    Channel& channel = channels[record.messages[n].channel];
+    uint16_t id = record.messages[n].id;
+    SendSlot& slot = channel.send_slots[id % window];
+    if(slot.id == id && slot.state == SlotState::SENT)
+      slot.state = SlotState::ACKED;
+  }
+}
+
+bool Connection::AcceptMessage(Channel& channel, uint16_t id,
+                               const uint8_t* data, size_t len) {
+  size_t n = id % window;
+  ReceiveSlot& slot = channel.receive_slots[n];
+  switch(channel.mode) {
+  case ChannelMode::ORDERED_RELIABLE:
+  case ChannelMode::UNORDERED_RELIABLE:
+    /* already delivered? */
+    if(seq_newer(channel.receive_base, id)) return true;
+    /* no room for it yet; refuse it, so the peer will send it again */
+    if((uint16_t)(id - channel.receive_base) >= window) return false;
+    /* already have it? */
+    if(slot.id == id && slot.state != SlotState::FREE) return true;
+    if(channel.mode == ChannelMode::UNORDERED_RELIABLE) {
+      channel.ready[(channel.ready_head + channel.ready_count++) % window]
+        = id;
+    }
+    break;
+  case ChannelMode::UNRELIABLE_SEQUENCED:
+    if(channel.have_received && !seq_newer(id, channel.receive_last))
+      return true;
+    channel.have_received = true;
+    channel.receive_last = id;
+    /* nobody's reading; drop it */
+    if(channel.ready_count >= window) return true;
+    n = (channel.receive_base + channel.ready_count++) % window;
+    break;
+  }
+  ReceiveSlot& target = channel.receive_slots[n];
+  target.id = id;
+  target.len = len;
+  target.state = SlotState::READY;
+  memcpy(channel.receive_data.get() + n * slot_size, data, len);
+  return true;
+}
+
+bool Connection::HandlePacket(const void* data, size_t len,
+                              uint64_t now_us) {
+  const uint8_t* const start = reinterpret_cast<const uint8_t*>(data);
+  const uint8_t* const end = start + len;
+  if(len < PACKET_HEADER_SIZE) return false;
+  /* a probe has nothing in it but padding */
+  const uint8_t* const body = start[8] & FLAG_PROBE ? end
+    : start + PACKET_HEADER_SIZE;
+  /* check the whole thing before acting on any of it */
+  for(const uint8_t* p = body; p != end;) {
+    if((size_t)(end - p) < MESSAGE_HEADER_SIZE) return false;
+    size_t msglen = get16(p + 3);
+    if(*p >= num_channels || msglen > slot_size
+       || (size_t)(end - p) - MESSAGE_HEADER_SIZE < msglen)
+      return false;
+    p += MESSAGE_HEADER_SIZE + msglen;
+  }
+  uint16_t seq = get16(start);
+  /* acking a bare ack would just start an endless exchange of them */
+  bool needs_ack = body != end || (start[8] & FLAG_PROBE);
+  if(start[8] & FLAG_HAS_ACK) {
+    uint16_t ack = get16(start + 2);
+    uint32_t ack_bits = get32(start + 4);
+    HandleAck(ack, now_us);
+    for(int n = 0; n < 32; ++n) {
+      if(ack_bits & (1U << n)) HandleAck(ack - 1 - n, now_us);
+    }
+    for(size_t index = 0; index < num_channels; ++index) {
+      Channel& channel = channels[index];
+      if(!channel.IsReliable()) continue;
+      while(channel.send_base != channel.send_next) {
+        SendSlot& slot = channel.send_slots[channel.send_base % window];
+        if(slot.state != SlotState::ACKED) break;
+        slot.state = SlotState::FREE;
+        ++channel.send_base;
+      }
+    }
+  }
+  /* duplicate (or too old to tell)? it still deserves an ack */
+  if(have_received && !seq_newer(seq, received_seq)) {
+    uint16_t age = received_seq - seq;
+    if(age == 0 || age > 32 || (received_bits & (1U << (age - 1)))) {
+      if(needs_ack) ack_pending = true;
+      return true;
+    }
+  }
+  bool accepted = true;
+  for(const uint8_t* p = body; p != end;) {
+    size_t msglen = get16(p + 3);
+    if(!AcceptMessage(channels[*p], get16(p + 1), p + MESSAGE_HEADER_SIZE,
+                      msglen))
+      accepted = false;
+    p += MESSAGE_HEADER_SIZE + msglen;
+  }
+  /* if we had to refuse something, pretend we never got this packet */
+  if(!accepted) return true;
+  if(!have_received) {
+    have_received = true;
+    received_seq = seq;
+    received_bits = 0;
+  }
+  else if(seq_newer(seq, received_seq)) {
+    uint16_t shift = seq - received_seq;
+    received_bits = shift > 32 ? 0
+      : ((uint64_t)received_bits << shift | 1ULL << (shift - 1));
+    received_seq = seq;
+  }
+  else received_bits |= 1U << ((uint16_t)(received_seq - seq) - 1);
+  if(needs_ack) ack_pending = true;
+  return true;
+}
+
+bool Connection::Receive(size_t& channel_out, void* buf, size_t& len_out) {
+  for(size_t index = 0; index < num_channels; ++index) {
+    Channel& channel = channels[index];
+    size_t n;
+    switch(channel.mode) {
+    case ChannelMode::ORDERED_RELIABLE:
+      n = channel.receive_base % window;
+      if(channel.receive_slots[n].state != SlotState::READY
+         || channel.receive_slots[n].id != channel.receive_base)
+        continue;
+      channel.receive_slots[n].state = SlotState::FREE;
+      ++channel.receive_base;
+      break;
+    case ChannelMode::UNORDERED_RELIABLE:
+      if(channel.ready_count == 0) continue;
+      n = channel.ready[channel.ready_head] % window;
+      channel.ready_head = (channel.ready_head + 1) % window;
+      --channel.ready_count;
+      channel.receive_slots[n].state = SlotState::DELIVERED;
+      break;
+    case ChannelMode::UNRELIABLE_SEQUENCED:
+    default:
+      if(channel.ready_count == 0) continue;
+      n = channel.receive_base % window;
+      channel.receive_base = (n + 1) % window;
+      --channel.ready_count;
+      channel.receive_slots[n].state = SlotState::FREE;
+      break;
+    }
+    len_out = channel.receive_slots[n].len;
+    memcpy(buf, channel.receive_data.get() + n * slot_size, len_out);
+    channel_out = index;
+    if(channel.mode == ChannelMode::UNORDERED_RELIABLE) {
+      while(true) {
+        ReceiveSlot& slot = channel.receive_slots[channel.receive_base
+                                                  % window];
+        if(slot.id != channel.receive_base
+           || slot.state != SlotState::DELIVERED)
+          break;
+        slot.state = SlotState::FREE;
+        ++channel.receive_base;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+uint64_t Connection::GetNextDeadline() const {
+  if(ack_pending) return 0;
+  uint64_t ret = pmtu ? pmtu->GetNextProbeTime(rto_us * 2) : ~(uint64_t)0;
+  for(size_t index = 0; index < num_channels; ++index) {
+    const Channel& channel = channels[index];
+    if(!channel.IsReliable()) {
+      if(channel.send_base != channel.send_next) return 0;
+      continue;
+    }
+    for(uint16_t id = channel.send_base; id != channel.send_next; ++id) {
+      const SendSlot& slot = channel.send_slots[id % window];
+      if(slot.state == SlotState::QUEUED) return 0;
+      else if(slot.state == SlotState::SENT
+              && slot.last_sent_us + rto_us < ret)
+        ret = slot.last_sent_us + rto_us;
+    }
+  }
+  return ret;
+}
+
+IOResult Connection::Sent(IOResult result, size_t len, uint64_t now_us) {
+  if(result == IOResult::OKAY) return result;
+  bool probe = sent_packets[(uint16_t)(next_packet_seq - 1)
+                            % SENT_PACKET_HISTORY].probe_size != 0;
+  if(result == IOResult::MSGSIZE) {
+    if(!HandleMsgSize(len, probe, now_us)) return result;
+    /* rebuild it at the new MTU */
+    Unbuild();
+    return IOResult::OKAY;
+  }
+  Unbuild();
+  return result;
+}
+
+IOResult Connection::Flush(ErrorCode& error_out, SockDgram& sock,
+                           uint64_t now_us) {
+  size_t len;
+  while((len = BuildPacket(packet_buf.get(), now_us)) > 0) {
+    IOResult result = Sent(sock.Send(error_out, packet_buf.get(), len), len,
+                           now_us);
+    if(result != IOResult::OKAY) return result;
+  }
+  return IOResult::OKAY;
+}
+
+IOResult Connection::Flush(ErrorCode& error_out, ServerSockDgram& sock,
+                           const Address& address, uint64_t now_us) {
+  size_t len;
+  while((len = BuildPacket(packet_buf.get(), now_us)) > 0) {
+    IOResult result = Sent(sock.Send(error_out, packet_buf.get(), len,
+                                     address), len, now_us);
+    if(result != IOResult::OKAY) return result;
+  }
+  return IOResult::OKAY;
+}
@@ -0,0 +1,131 @@
+#ifndef NETCHANNELHH
+#define NETCHANNELHH
+
+#include "netsock.hh"
+#include "netpmtu.hh"
+
+namespace Net {
+  enum class ChannelMode : uint8_t {
+    /*
+      ORDERED_RELIABLE: every message arrives, in the order it was sent.
+      UNORDERED_RELIABLE: every message arrives, as soon as it arrives.
+      UNRELIABLE_SEQUENCED: messages may be lost, and messages older than
+        one that's already arrived are dropped. Never resent.
+    */
+    ORDERED_RELIABLE, UNORDERED_RELIABLE, UNRELIABLE_SEQUENCED
+  };
+  /*
+    A message-oriented connection over datagrams, carrying any number of
+    channels, each with its own ChannelMode. Both ends must be created with
+    the same list of modes.
+    Every packet acknowledges the last 33 packets received, with a sequence
+    number and a bitfield. Reliable messages are resent whenever
+    they've gone unacknowledged for longer than the retransmit timeout,
+    which is derived from a smoothed RTT estimate (as in TCP, RFC 6298),
+    and doubled every time it runs out, until the next acknowledgement.
+    All buffers are allocated up front; Send, BuildPacket, HandlePacket and
+    Receive never allocate. window is the number of messages, per channel,
+    that may be unacknowledged (or, when receiving, undelivered) at once.
+    The Connection doesn't own a socket. Use Flush to send its packets over
+    a SockDgram or ServerSockDgram (or BuildPacket to send them some other
+    way), and pass every datagram from the peer to HandlePacket.
+    Times are in microseconds, from any monotonic clock.
+    There's no handshake, connection identifier or congestion control; it's
+    up to you to decide who you're talking to.
+    If max_mtu is more than mtu, the Connection does path MTU discovery
+    (see PathMTU), with padded probe packets that the peer acknowledges like
+    any other. GetMTU() and GetMaxMessageSize() follow the discovered MTU.
+    Both ends must use the same max_mtu, and the socket should have
+    SetDontFragment(true).
+  */
+  class Connection {
+  public:
+    /* per packet: sequence number, ack, ack bitfield, flags */
+    static const size_t PACKET_HEADER_SIZE = 9;
+    /* per message: channel, message ID, length */
+    static const size_t MESSAGE_HEADER_SIZE = 5;
+    /* more than this many messages in a packet aren't worth tracking */
+    static const size_t MAX_MESSAGES_PER_PACKET = 64;
+  private:
+    struct Channel;
+    struct SentPacket;
+    std::unique_ptr<Channel[]> channels;
+    std::unique_ptr<SentPacket[]> sent_packets;
+    size_t num_channels, window, mtu, max_mtu, max_message_size, slot_size;
+    std::unique_ptr<PathMTU> pmtu;
+    std::unique_ptr<uint8_t[]> packet_buf;
+    uint16_t next_packet_seq;
+    /* the most recent packet received, and which of the 32 before it were
+       received as well */
+    uint16_t received_seq;
+    uint32_t received_bits;
+    bool have_received, ack_pending;
+    uint64_t srtt_us, rttvar_us, rto_us;
+    /* when rto_us was last doubled, so that one timeout that's spread over
+       several packets only doubles it once */
+    uint64_t backoff_us;
+    /* enough to undo the last BuildPacket, if its packet couldn't be sent:
+       ack_pending as it was, and each reliable message's last_sent_us as it
+       was (~0 if it was QUEUED) */
+    bool built_ack_pending;
+    uint64_t built_rto_us, built_backoff_us;
+    uint64_t built_sent_us[MAX_MESSAGES_PER_PACKET];
+    void HandleAck(uint16_t seq, uint64_t now_us);
+    void UpdateMTU();
+    /* puts everything in the last packet back the way it was */
+    void Unbuild();
+    /* returns true if it's worth trying again at a smaller size */
+    bool HandleMsgSize(size_t len, bool probe, uint64_t now_us);
+    IOResult Sent(IOResult result, size_t len, uint64_t now_us);
+    bool AcceptMessage(Channel& channel, uint16_t id,
+                       const uint8_t* data, size_t len);
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+  public:
+    /* mtu is usually the peer Address's GetEstimatedDgramMTU(), max_mtu its
+       GetEthernetDgramMTU(); 0 means no path MTU discovery */
+    Connection(const ChannelMode* modes, size_t num_channels, size_t mtu,
+               size_t window = 32, size_t max_mtu = 0);
+    ~Connection();
+    /* Returns false, and sends nothing, if the channel doesn't exist, the
+       message is larger than GetMaxMessageSize(), or the channel's window
+       is full. */
+    bool Send(size_t channel, const void* data, size_t len);
+    /* Returns false if the packet was malformed. */
+    bool HandlePacket(const void* data, size_t len, uint64_t now_us);
+    /* Returns false if there is no message ready. buf must have room for
+       GetLargestMessageSize() bytes. */
+    bool Receive(size_t& channel_out, void* buf, size_t& len_out);
+    /* Writes the next packet that needs to be sent now into buf (which must
+       have room for GetMaxMTU() bytes), and returns its size; returns 0 if
+       nothing needs sending yet. Messages that were queued before the MTU
+       shrank, and no longer fit, get a packet to themselves. */
+    size_t BuildPacket(void* buf, uint64_t now_us);
+    /* BuildPacket and send, until there's nothing left that needs sending
+       now (or the socket would block). A packet that couldn't be sent is
+       taken back, and its messages (and ack) go in a later one; after an
+       MSGSIZE that shrinks the MTU, that's straight away. MSGSIZE is only
+       returned if path MTU discovery is off, or the packet was no bigger
+       than the base MTU, or was a message too big for the new MTU (which
+       is then treated as sent, and resent after the usual timeout). */
+    IOResult Flush(ErrorCode& error_out, SockDgram& sock, uint64_t now_us);
+    IOResult Flush(ErrorCode& error_out, ServerSockDgram& sock,
+                   const Address& address, uint64_t now_us);
+    /* The next time at which BuildPacket will have something to send, if
+       nothing else happens before then; ~0 if never. May be in the past. */
+    uint64_t GetNextDeadline() const;
+    inline size_t GetMTU() const { return mtu; }
+    inline size_t GetMaxMTU() const { return max_mtu; }
+    /* the largest message Send will currently accept */
+    inline size_t GetMaxMessageSize() const { return max_message_size; }
+    /* the largest message that could ever be sent or received */
+    inline size_t GetLargestMessageSize() const { return slot_size; }
+    /* null if path MTU discovery is off */
+    inline const PathMTU* GetPathMTU() const { return pmtu.get(); }
+    /* zero until the first acknowledgement */
+    inline uint64_t GetSmoothedRTT() const { return srtt_us; }
+    inline uint64_t GetRetransmitTimeout() const { return rto_us; }
+  };
+}
+
+#endif
@@ -0,0 +1,629 @@
+#include "netcomplete.hh"
+
+#include <deque>
+
+#if __linux__ && !defined(TEG_NO_IO_URING)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#define HAVE_IO_URING 0
+#endif
+
+using namespace Net;
+
+/* user_data values for SQEs that aren't Operations */
+#define IGNORED_TAG (~(uint64_t)0)
+#define TIMEOUT_TAG (~(uint64_t)0 - 1)
+/* set in user_data for the POLL_ADD that precedes a retried Operation */
+#define POLL_BIT (1ULL << 63)
+
+enum class CompletionQueue::Kind : uint8_t { STREAM, DGRAM, SERVER_DGRAM };
+
+struct CompletionQueue::Operation {
+  Sock* sock;
+  void* userdata;
+  size_t buffer, len;
+  /* when this Operation is free, the index of the next free one */
+  size_t next_free;
+  Kind kind;
+  ErrorCode::Op op;
+  bool in_use;
+  Address address;
+#if HAVE_IO_URING
+  struct msghdr msg;
+  struct iovec iov;
+#endif
+};
+
+struct CompletionQueue::SockState {
+  /* Operations waiting their turn, oldest first; [0] is receives, [1] is
+     sends. With io_uring, only SockStream operations are queued, and the
+     first one is in the kernel. Otherwise, everything is queued here. */
+  std::deque<size_t> queue[2];
+  /* what the Poller is currently watching for */
+  bool want_read, want_write;
+  SockState() : want_read(false), want_write(false) {}
+};
+
+#if HAVE_IO_URING
+struct CompletionQueue::Uring {
+  int fd;
+  void* sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  unsigned* sq_head, *sq_tail, *sq_array;
+  unsigned* cq_head, *cq_tail;
+  unsigned sq_mask, sq_entries, cq_mask;
+  /* SQEs filled in since the last io_uring_enter */
+  unsigned to_submit;
+  bool fixed, ext_arg, timeout_pending;
+  struct __kernel_timespec timeout;
+  Uring() : fd(-1), sq_map(MAP_FAILED), cq_map(MAP_FAILED),
+            sqes(reinterpret_cast<struct io_uring_sqe*>(MAP_FAILED)),
+            to_submit(0), fixed(false), ext_arg(false),
+            timeout_pending(false) {}
+  ~Uring() {
+    if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if(cq_map != MAP_FAILED && cq_map != sq_map) munmap(cq_map, cq_map_size);
+    if(sq_map != MAP_FAILED) munmap(sq_map, sq_map_size);
+    if(fd >= 0) close(fd);
+  }
+  int Enter(unsigned min_complete, const struct __kernel_timespec* ts
+            = nullptr) {
+    int ret;
+    if(ts) {
+      struct io_uring_getevents_arg arg;
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = reinterpret_cast<uintptr_t>(ts);
+      ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                    &arg, sizeof(arg));
+    }
+    else
+      ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                    min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if(ret > 0) to_submit -= ret;
+    return ret;
+  }
+  /* returns count consecutive SQEs, submitting what's already there if
+     necessary to make room */
+  struct io_uring_sqe* GetSQEs(unsigned count) {
+    unsigned tail = *sq_tail;
+    while(tail + count - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)
+          > sq_entries) {
+      if(Enter(0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        die("io_uring_enter: %s", strerror(errno));
+    }
+    struct io_uring_sqe* ret = nullptr;
+    for(unsigned n = 0; n < count; ++n) {
+      unsigned index = (tail + n) & sq_mask;
+      sq_array[index] = index;
+      if(!ret) ret = &sqes[index];
+      memset(&sqes[index], 0, sizeof(*sqes));
+    }
+    __atomic_store_n(sq_tail, tail + count, __ATOMIC_RELEASE);
+    to_submit += count;
+    return ret;
+  }
+};
+#else
+struct CompletionQueue::Uring {};
+#endif
+
+CompletionQueue::CompletionQueue()
+  : max_pending(0), num_pending(0), free_head(0), num_buffers(0),
+    buffer_size(0) {}
+
+CompletionQueue::~CompletionQueue() {}
+
+bool CompletionQueue::IsUring() const {
+  return uring != nullptr;
+}
+
+bool CompletionQueue::Init(std::string& error_out, size_t max_pending,
+                           size_t num_buffers, size_t buffer_size,
+                           bool use_uring) {
+  assert(max_pending > 0 && num_buffers > 0 && buffer_size > 0);
+  assert(!operations);
+  this->max_pending = max_pending;
+  this->num_buffers = num_buffers;
+  this->buffer_size = buffer_size;
+  operations.reset(new Operation[max_pending]);
+  for(size_t n = 0; n < max_pending; ++n) {
+    operations[n].in_use = false;
+    operations[n].next_free = n + 1;
+  }
+  free_head = 0;
+  buffers.reset(new uint8_t[num_buffers * buffer_size]);
+#if HAVE_IO_URING
+  if(use_uring) {
+    bool fixed;
+    if(InitUring(error_out, fixed)) {
+      if(!fixed) {
+        error_out = "Could not register io_uring buffers";
+        fprintf(stderr, "WARNING: %s\n", error_out.c_str());
+      }
+      return true;
+    }
+    fprintf(stderr, "WARNING: %s (falling back to a Poller)\n",
+            error_out.c_str());
+    uring.reset();
+  }
+#else
+  if(use_uring) error_out = "io_uring support was not compiled in";
+#endif
+  poller.reset(new Poller());
+  return true;
+}
+
+#if HAVE_IO_URING
+bool CompletionQueue::InitUring(std::string& error_out, bool& fixed_out) {
+  uring.reset(new Uring());
+  Uring& u = *uring;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  /* every Operation can have an extra CQE from a POLL_ADD, and another from
+     a cancellation */
+  unsigned entries = max_pending < 8 ? 8 : max_pending > 4096 ? 4096
+    : max_pending;
+  params.cq_entries = entries * 4;
+  u.fd = syscall(__NR_io_uring_setup, entries, &params);
+  if(u.fd < 0) {
+    error_out = std::string("Could not set up io_uring: ")
+      + strerror(errno);
+    return false;
+  }
+  static const uint8_t needed_ops[] = {
+    IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_RECV,
+    IORING_OP_SEND, IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+    IORING_OP_POLL_ADD, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+  };
+  const size_t probe_size = sizeof(struct io_uring_probe)
+    + 256 * sizeof(struct io_uring_probe_op);
+  std::unique_ptr<uint8_t[]> probe_buf(new uint8_t[probe_size]());
+  struct io_uring_probe* probe
+    = reinterpret_cast<struct io_uring_probe*>(probe_buf.get());
+  if(syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_PROBE,
+             probe, 256) < 0) {
+    error_out = "io_uring is too old (no IORING_REGISTER_PROBE)";
+    return false;
+  }
+  for(uint8_t op : needed_ops) {
+    if(op > probe->last_op
+       || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      error_out = "io_uring is too old (missing needed operations)";
+      return false;
+    }
+  }
+  u.ext_arg = params.features & IORING_FEAT_EXT_ARG;
+  u.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  u.cq_map_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(u.cq_map_size > u.sq_map_size) u.sq_map_size = u.cq_map_size;
+    u.cq_map_size = u.sq_map_size;
+  }
+  u.sq_map = mmap(nullptr, u.sq_map_size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, u.fd, IORING_OFF_SQ_RING);
+  if(u.sq_map == MAP_FAILED) {
+    error_out = std::string("Could not map io_uring: ") + strerror(errno);
+    return false;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    u.cq_map = u.sq_map;
+  else {
+    u.cq_map = mmap(nullptr, u.cq_map_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, u.fd, IORING_OFF_CQ_RING);
+    if(u.cq_map == MAP_FAILED) {
+      error_out = std::string("Could not map io_uring: ") + strerror(errno);
+      return false;
+    }
+  }
+  u.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, u.sqes_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, u.fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) {
+    error_out = std::string("Could not map io_uring: ") + strerror(errno);
+    return false;
+  }
+  u.sqes = reinterpret_cast<struct io_uring_sqe*>(sqes);
+  uint8_t* sq = reinterpret_cast<uint8_t*>(u.sq_map);
+  uint8_t* cq = reinterpret_cast<uint8_t*>(u.cq_map);
+  u.sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  u.sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  u.sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  u.sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  u.sq_entries = params.sq_entries;
+  u.cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  u.cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  u.cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  u.cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  /* registering can fail on RLIMIT_MEMLOCK; we can live without it */
+  std::unique_ptr<struct iovec[]> iovs(new struct iovec[num_buffers]);
+  for(size_t n = 0; n < num_buffers; ++n) {
+    iovs[n].iov_base = GetBuffer(n);
+    iovs[n].iov_len = buffer_size;
+  }
+  u.fixed = num_buffers <= 16384
+    && syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS,
+               iovs.get(), (unsigned)num_buffers) == 0;
+  fixed_out = u.fixed;
+  return true;
+}
+
+void CompletionQueue::SubmitUring(size_t index, bool poll_first) {
+  Uring& u = *uring;
+  Operation& o = operations[index];
+  bool receive = o.op == ErrorCode::Op::RECEIVE;
+  uint8_t* buf = GetBuffer(o.buffer);
+  struct io_uring_sqe* sqe = u.GetSQEs(poll_first ? 2 : 1);
+  if(poll_first) {
+    /* the socket wasn't ready, and this kernel won't wait for it on its own
+       (it honors O_NONBLOCK) */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = o.sock->sock;
+    sqe->poll32_events = receive ? POLLIN : POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = index | POLL_BIT;
+    sqe = &u.sqes[(sqe - u.sqes + 1) & u.sq_mask];
+  }
+  sqe->fd = o.sock->sock;
+  sqe->user_data = index;
+  if(o.kind == Kind::SERVER_DGRAM) {
+    o.iov.iov_base = buf;
+    o.iov.iov_len = receive ? buffer_size : o.len;
+    memset(&o.msg, 0, sizeof(o.msg));
+    o.msg.msg_name = &o.address.storage;
+    o.msg.msg_namelen = receive ? sizeof(o.address.storage)
+      : o.address.Length();
+    o.msg.msg_iov = &o.iov;
+    o.msg.msg_iovlen = 1;
+    sqe->opcode = receive ? IORING_OP_RECVMSG : IORING_OP_SENDMSG;
+    sqe->addr = reinterpret_cast<uintptr_t>(&o.msg);
+    sqe->len = 1;
+  }
+  else {
+    if(u.fixed) {
+      sqe->opcode = receive ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      sqe->buf_index = o.buffer;
+    }
+    else sqe->opcode = receive ? IORING_OP_RECV : IORING_OP_SEND;
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = receive ? buffer_size : o.len;
+  }
+}
+
+void CompletionQueue::HandleUringCompletion(uint64_t user_data,
+                                            int32_t res) {
+  if(user_data == TIMEOUT_TAG) {
+    uring->timeout_pending = false;
+    return;
+  }
+  if(user_data == IGNORED_TAG || (user_data & POLL_BIT)) return;
+  size_t index = user_data;
+  Operation& o = operations[index];
+  IOResult result = IOResult::OKAY;
+  ErrorCode error;
+  error.op = o.op;
+  size_t len = 0;
+  if(res >= 0) {
+    len = res;
+    if(o.kind == Kind::STREAM && o.op == ErrorCode::Op::RECEIVE && res == 0)
+      error.err = ErrorCode::CLOSED, result = IOResult::CONNECTION_CLOSED;
+    else if(o.kind != Kind::STREAM && o.op == ErrorCode::Op::SEND
+            && len != o.len)
+      error.err = ErrorCode::TRUNCATED, result = IOResult::ERROR;
+  }
+  else {
+    error.err = -res;
+    switch(-res) {
+    case EAGAIN:
+      SubmitUring(index, true);
+      return;
+    case EINTR:
+      SubmitUring(index, false);
+      return;
+    case ECANCELED:
+      error.err = ErrorCode::CANCELED;
+      result = IOResult::ERROR;
+      break;
+    case EMSGSIZE:
+      result = o.kind != Kind::STREAM && o.op == ErrorCode::Op::SEND
+        ? IOResult::MSGSIZE : IOResult::ERROR;
+      break;
+    case ECONNREFUSED:
+      result = IOResult::CONNECTION_CLOSED;
+      break;
+    case EPIPE:
+      result = o.op == ErrorCode::Op::SEND ? IOResult::CONNECTION_CLOSED
+        : IOResult::ERROR;
+      break;
+    default:
+      result = IOResult::ERROR;
+      break;
+    }
+  }
+  error.result = result;
+  Sock* sock = o.sock;
+  bool send = o.op == ErrorCode::Op::SEND;
+  Kind kind = o.kind;
+  Complete(index, result, error, len, completions);
+  if(kind == Kind::STREAM) {
+    auto it = socks.find(sock);
+    assert(it != socks.end());
+    std::deque<size_t>& queue = it->second.queue[send];
+    assert(!queue.empty() && queue.front() == index);
+    queue.pop_front();
+    if(!queue.empty()) SubmitUring(queue.front(), false);
+    else if(it->second.queue[!send].empty()) socks.erase(it);
+  }
+}
+#endif
+
+void CompletionQueue::Complete(size_t index, IOResult result,
+                               const ErrorCode& error, size_t len,
+                               std::vector<Completion>& out) {
+  Operation& o = operations[index];
+  out.emplace_back();
+  Completion& completion = out.back();
+  completion.sock = o.sock;
+  completion.userdata = o.userdata;
+  completion.op = o.op;
+  completion.result = result;
+  completion.error = error;
+  completion.buffer = o.buffer;
+  completion.len = result == IOResult::OKAY ? len : 0;
+  if(o.kind == Kind::SERVER_DGRAM) completion.address = o.address;
+  o.in_use = false;
+  o.next_free = free_head;
+  free_head = index;
+  --num_pending;
+}
+
+IOResult CompletionQueue::Attempt(Operation& o, ErrorCode& error_out) {
+  uint8_t* buf = GetBuffer(o.buffer);
+  bool receive = o.op == ErrorCode::Op::RECEIVE;
+  if(receive) o.len = buffer_size;
+  switch(o.kind) {
+  case Kind::STREAM: {
+    SockStream& sock = *static_cast<SockStream*>(o.sock);
+    return receive ? sock.Receive(error_out, buf, o.len)
+      : sock.Send(error_out, buf, o.len);
+  }
+  case Kind::DGRAM: {
+    SockDgram& sock = *static_cast<SockDgram*>(o.sock);
+    return receive ? sock.Receive(error_out, buf, o.len)
+      : sock.Send(error_out, buf, o.len);
+  }
+  case Kind::SERVER_DGRAM:
+  default: {
+    ServerSockDgram& sock = *static_cast<ServerSockDgram*>(o.sock);
+    return receive ? sock.Receive(error_out, buf, o.len, o.address)
+      : sock.Send(error_out, buf, o.len, o.address);
+  }
+  }
+}
+
+void CompletionQueue::Progress(SockState& state, bool send) {
+  std::deque<size_t>& queue = state.queue[send];
+  while(!queue.empty()) {
+    size_t index = queue.front();
+    ErrorCode error;
+    IOResult result = Attempt(operations[index], error);
+    if(result == IOResult::WOULD_BLOCK) break;
+    queue.pop_front();
+    Complete(index, result, error, operations[index].len, completions);
+  }
+}
+
+void CompletionQueue::UpdateInterest(Sock& sock, SockState& state) {
+  bool want_read = !state.queue[0].empty();
+  bool want_write = !state.queue[1].empty();
+  if(!want_read && !want_write) {
+    poller->Unregister(sock);
+    socks.erase(&sock);
+  }
+  else if(want_read != state.want_read || want_write != state.want_write) {
+    std::string error;
+    if(!poller->Modify(error, sock, want_read, want_write))
+      die("Poller::Modify: %s", error.c_str());
+    state.want_read = want_read;
+    state.want_write = want_write;
+  }
+}
+
+bool CompletionQueue::Submit(Sock& sock, Kind kind, ErrorCode::Op op,
+                             size_t buffer, size_t len,
+                             const Address* address, void* userdata) {
+  assert(buffer < num_buffers && len <= buffer_size);
+  if(!operations || !sock.Valid() || free_head >= max_pending) return false;
+  size_t index = free_head;
+  Operation& o = operations[index];
+  o.sock = &sock;
+  o.userdata = userdata;
+  o.buffer = buffer;
+  o.len = len;
+  o.kind = kind;
+  o.op = op;
+  if(address) o.address = *address;
+  bool send = op == ErrorCode::Op::SEND;
+  if(uring) {
+#if HAVE_IO_URING
+    free_head = o.next_free;
+    o.in_use = true;
+    ++num_pending;
+    if(kind == Kind::STREAM) {
+      std::deque<size_t>& queue = socks[&sock].queue[send];
+      queue.push_back(index);
+      if(queue.size() > 1) return true;
+    }
+    SubmitUring(index, false);
+#endif
+    return true;
+  }
+  auto it = socks.find(&sock);
+  if(it == socks.end() || it->second.queue[send].empty()) {
+    /* might as well try it now */
+    ErrorCode error;
+    IOResult result = Attempt(o, error);
+    if(result != IOResult::WOULD_BLOCK) {
+      free_head = o.next_free;
+      o.in_use = true;
+      ++num_pending;
+      Complete(index, result, error, o.len, ready);
+      return true;
+    }
+  }
+  if(it == socks.end()) {
+    std::string error;
+    if(!poller->Register(error, sock, !send, send)) return false;
+    it = socks.insert(std::make_pair(&sock, SockState())).first;
+    it->second.want_read = !send;
+    it->second.want_write = send;
+  }
+  free_head = o.next_free;
+  o.in_use = true;
+  ++num_pending;
+  it->second.queue[send].push_back(index);
+  UpdateInterest(sock, it->second);
+  return true;
+}
+
+bool CompletionQueue::Receive(SockStream& sock, size_t buffer,
+                              void* userdata) {
+  return Submit(sock, Kind::STREAM, ErrorCode::Op::RECEIVE, buffer, 0,
+                nullptr, userdata);
+}
+
+bool CompletionQueue::Send(SockStream& sock, size_t buffer, size_t len,
+                           void* userdata) {
+  return Submit(sock, Kind::STREAM, ErrorCode::Op::SEND, buffer, len,
+                nullptr, userdata);
+}
+
+bool CompletionQueue::Receive(SockDgram& sock, size_t buffer,
+                              void* userdata) {
+  return Submit(sock, Kind::DGRAM, ErrorCode::Op::RECEIVE, buffer, 0,
+                nullptr, userdata);
+}
+
+bool CompletionQueue::Send(SockDgram& sock, size_t buffer, size_t len,
+                           void* userdata) {
+  return Submit(sock, Kind::DGRAM, ErrorCode::Op::SEND, buffer, len,
+                nullptr, userdata);
+}
+
+bool CompletionQueue::Receive(ServerSockDgram& sock, size_t buffer,
+                              void* userdata) {
+  return Submit(sock, Kind::SERVER_DGRAM, ErrorCode::Op::RECEIVE, buffer, 0,
+                nullptr, userdata);
+}
+
+bool CompletionQueue::Send(ServerSockDgram& sock, size_t buffer, size_t len,
+                           const Address& address, void* userdata) {
+  return Submit(sock, Kind::SERVER_DGRAM, ErrorCode::Op::SEND, buffer, len,
+                &address, userdata);
+}
+
+void CompletionQueue::Cancel(Sock& sock) {
+  ErrorCode error;
+  error.result = IOResult::ERROR;
+  error.err = ErrorCode::CANCELED;
+  auto it = socks.find(&sock);
+  if(it != socks.end()) {
+    /* whatever hasn't reached the kernel can be canceled right now */
+    for(int send = 0; send < 2; ++send) {
+      std::deque<size_t>& queue = it->second.queue[send];
+      while(queue.size() > (uring ? 1 : 0)) {
+        error.op = operations[queue.back()].op;
+        Complete(queue.back(), IOResult::ERROR, error, 0, ready);
+        queue.pop_back();
+      }
+    }
+    if(!uring) UpdateInterest(sock, it->second);
+  }
+#if HAVE_IO_URING
+  if(uring) {
+    for(size_t index = 0; index < max_pending; ++index) {
+      Operation& o = operations[index];
+      if(!o.in_use || o.sock != &sock) continue;
+      struct io_uring_sqe* sqe = uring->GetSQEs(2);
+      sqe[0].opcode = IORING_OP_ASYNC_CANCEL;
+      sqe[0].fd = -1;
+      sqe[0].addr = index;
+      sqe[0].user_data = IGNORED_TAG;
+      sqe = &uring->sqes[(sqe - uring->sqes + 1) & uring->sq_mask];
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = index | POLL_BIT;
+      sqe->user_data = IGNORED_TAG;
+    }
+  }
+#endif
+}
+
+const std::vector<CompletionQueue::Completion>&
+CompletionQueue::Wait(size_t max_timeout_us) {
+  completions.clear();
+  completions.swap(ready);
+  if(!completions.empty()) max_timeout_us = 0;
+#if HAVE_IO_URING
+  if(uring) {
+    Uring& u = *uring;
+    unsigned min_complete = 0;
+    const struct __kernel_timespec* ts = nullptr;
+    if(max_timeout_us != 0 && max_timeout_us != ~(size_t)0) {
+      u.timeout.tv_sec = max_timeout_us / 1000000;
+      u.timeout.tv_nsec = (max_timeout_us % 1000000) * 1000;
+    }
+    if(max_timeout_us == ~(size_t)0) min_complete = 1;
+    else if(max_timeout_us == 0) {}
+    else if(u.ext_arg) {
+      /* 5.11 and later can take the timeout directly */
+      ts = &u.timeout;
+      min_complete = 1;
+    }
+    else if(!u.timeout_pending) {
+      /* wakes us up after the timeout, or after one other completion */
+      struct io_uring_sqe* sqe = u.GetSQEs(1);
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = reinterpret_cast<uintptr_t>(&u.timeout);
+      sqe->len = 1;
+      sqe->off = 1;
+      sqe->user_data = TIMEOUT_TAG;
+      u.timeout_pending = true;
+      min_complete = 1;
+    }
+    if(u.Enter(min_complete, ts) < 0 && errno != EINTR && errno != EAGAIN
+       && errno != EBUSY && errno != ETIME)
+      die("io_uring_enter: %s", strerror(errno));
+    unsigned head = *u.cq_head;
+    while(head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe& cqe = u.cqes[head & u.cq_mask];
+      uint64_t user_data = cqe.user_data;
+      int32_t res = cqe.res;
+      ++head;
+      __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+      HandleUringCompletion(user_data, res);
+    }
+    return completions;
+  }
+#endif
+  const std::vector<Poller::Event>& events = poller->Wait(max_timeout_us);
+  for(const Poller::Event& event : events) {
+    auto it = socks.find(event.sock);
+    if(it == socks.end()) continue;
+    if(event.readable) Progress(it->second, false);
+    if(event.writable) Progress(it->second, true);
+    UpdateInterest(*event.sock, it->second);
+  }
+  return completions;
+}
@@ -0,0 +1,113 @@
+#ifndef NETCOMPLETEHH
+#define NETCOMPLETEHH
+
+#include "netsock.hh"
+
+namespace Net {
+  /*
+    Completion-driven socket IO. Instead of waiting for a Sock to become
+    readable or writable and then trying the operation, you submit the
+    operation up front, against one of the queue's buffers, and Wait hands
+    back a Completion once it's been done.
+    On Linux this is io_uring, with the buffers registered with the kernel,
+    and a single system call per Wait that both submits and reaps. Where
+    io_uring isn't available (other platforms, kernels older than 5.6,
+    io_uring disabled by sysctl or seccomp, TEG_NO_IO_URING defined, or
+    use_uring false), the same interface is provided on top of a Poller and
+    the ordinary non-blocking calls.
+    Operations on the same SockStream in the same direction are done one at
+    a time, in the order they were submitted, and may complete partially (as
+    with SockStream::Send and Receive). Datagram operations may complete in
+    any order.
+    A Sock must not be closed, moved or destroyed while it has operations
+    pending. Cancel them, and Wait for their completions, first.
+    Not thread safe.
+  */
+  class CompletionQueue {
+  public:
+    struct Completion {
+      Sock* sock;
+      void* userdata;
+      ErrorCode::Op op;
+      IOResult result;
+      /* only meaningful if result isn't OKAY */
+      ErrorCode error;
+      size_t buffer;
+      /* the number of bytes received or sent */
+      size_t len;
+      /* the sender, for ServerSockDgram receives */
+      Address address;
+    };
+  private:
+    enum class Kind : uint8_t;
+    struct Operation;
+    struct SockState;
+    struct Uring;
+    std::unique_ptr<Operation[]> operations;
+    size_t max_pending, num_pending, free_head;
+    std::unique_ptr<uint8_t[]> buffers;
+    size_t num_buffers, buffer_size;
+    std::vector<Completion> completions;
+    std::unique_ptr<Uring> uring;
+    /* fallback only */
+    std::unique_ptr<Poller> poller;
+    std::unordered_map<Sock*, SockState> socks;
+    std::vector<Completion> ready;
+    bool Submit(Sock& sock, Kind kind, ErrorCode::Op op, size_t buffer,
+                size_t len, const Address* address, void* userdata);
+    void Complete(size_t index, IOResult result, const ErrorCode& error,
+                  size_t len, std::vector<Completion>& out);
+    bool InitUring(std::string& error_out, bool& fixed_out);
+    void SubmitUring(size_t index, bool poll_first);
+    void HandleUringCompletion(uint64_t user_data, int32_t res);
+    IOResult Attempt(Operation& operation, ErrorCode& error_out);
+    void Progress(SockState& state, bool send);
+    void UpdateInterest(Sock& sock, SockState& state);
+    CompletionQueue(const CompletionQueue&) = delete;
+    CompletionQueue& operator=(const CompletionQueue&) = delete;
+  public:
+    CompletionQueue();
+    ~CompletionQueue();
+    /* max_pending is the most operations that may be pending at once.
+       Always succeeds; if use_uring was asked for and we had to fall back
+       to a Poller (or couldn't register the buffers), error_out says why. */
+    bool Init(std::string& error_out, size_t max_pending = 256,
+              size_t num_buffers = 64, size_t buffer_size = 2048,
+              bool use_uring = true);
+    /* true if we're using io_uring, false if we're using a Poller */
+    bool IsUring() const;
+    inline size_t GetBufferCount() const { return num_buffers; }
+    inline size_t GetBufferSize() const { return buffer_size; }
+    inline uint8_t* GetBuffer(size_t index) {
+      assert(index < num_buffers);
+      return buffers.get() + index * buffer_size;
+    }
+    /* The buffer belongs to the queue until the operation completes.
+       Receives fill up to GetBufferSize() bytes of it; sends send the first
+       len bytes of it. These return false if the Sock is invalid or too many
+       operations are pending. */
+    bool Receive(SockStream& sock, size_t buffer, void* userdata = nullptr);
+    bool Send(SockStream& sock, size_t buffer, size_t len,
+              void* userdata = nullptr);
+    bool Receive(SockDgram& sock, size_t buffer, void* userdata = nullptr);
+    bool Send(SockDgram& sock, size_t buffer, size_t len,
+              void* userdata = nullptr);
+    bool Receive(ServerSockDgram& sock, size_t buffer,
+                 void* userdata = nullptr);
+    bool Send(ServerSockDgram& sock, size_t buffer, size_t len,
+              const Address& address, void* userdata = nullptr);
+    /* Every operation pending on the Sock completes soon, with the
+       ErrorCode::CANCELED error if it hadn't already been done. */
+    void Cancel(Sock& sock);
+    /* Submits whatever's been queued, and waits for at least one completion
+       (or the timeout). The returned list is only valid until the next call
+       to Wait. May return an empty list early. */
+    const std::vector<Completion>& Wait(size_t max_timeout_us = ~(size_t)0);
+    /* operations whose completions haven't been returned by Wait yet */
+    inline size_t GetPendingCount() const {
+      return num_pending + ready.size();
+    }
+  };
+}
+
+#endif
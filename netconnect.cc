@@ -0,0 +1,212 @@
+#include "netconnect.hh"
+#include "nettimer.hh"
+
+using namespace Net;
+
+#define NEVER (~(uint64_t)0)
+#define NOBODY (~(size_t)0)
+
+Connector::Connector(uint64_t attempt_delay_us, uint64_t timeout_us)
+  : poller(nullptr), attempt_delay_us(attempt_delay_us),
+    timeout_us(timeout_us), start_us(0), next_attempt_us(NEVER),
+    next_attempt(0), winner(NOBODY), done(false) {}
+
+Connector::~Connector() {
+  Abandon();
+}
+
+bool Connector::Start(std::string& error_out,
+                      const std::forward_list<Address>& addresses,
+                      Poller& poller, uint64_t now_us) {
+  Abandon();
+  attempts.clear();
+  socks.clear();
+  error.clear();
+  winner = NOBODY;
+  done = false;
+  /* alternate families, keeping each family's own order, starting with
+     the first address's */
+  std::vector<const Address*> first, second;
+  int first_family = -1;
+  for(auto& address : addresses) {
+    if(first_family < 0) first_family = address.faceless.sa_family;
+    (address.faceless.sa_family == first_family ? first : second)
+      .push_back(&address);
+  }
+  for(size_t n = 0; n < first.size() || n < second.size(); ++n) {
+    for(auto list : {&first, &second}) {
+      if(n >= list->size()) continue;
+      attempts.emplace_back();
+      attempts.back().address = *(*list)[n];
+    }
+  }
+  if(attempts.empty()) {
+    error_out = "No addresses to connect to";
+    done = true;
+    error = error_out;
+    return false;
+  }
+  for(auto& attempt : attempts) {
+    attempt.state = Attempt::State::PENDING;
+    attempt.started_us = attempt.finished_us = NEVER;
+  }
+  socks.resize(attempts.size());
+  this->poller = &poller;
+  start_us = now_us;
+  next_attempt = 0;
+  StartNext(now_us);
+  return true;
+}
+
+void Connector::StartNext(uint64_t now_us) {
+  /* keep going until one's actually in flight (or we run out) */
+  while(!done && next_attempt < attempts.size()) {
+    size_t index = next_attempt++;
+    Attempt& attempt = attempts[index];
+    SockStream& sock = socks[index];
+    attempt.state = Attempt::State::CONNECTING;
+    attempt.started_us = now_us - start_us;
+    std::string why;
+    IOResult result = sock.Connect(why, attempt.address);
+    if(result == IOResult::OKAY) {
+      Finish(index, true, why, now_us);
+      return;
+    }
+    else if(result != IOResult::WOULD_BLOCK) {
+      Finish(index, false, why, now_us);
+      continue;
+    }
+    if(!poller->Register(why, sock, false, true, this)) {
+      sock.Close();
+      Finish(index, false, why, now_us);
+      continue;
+    }
+    next_attempt_us = now_us + attempt_delay_us;
+    return;
+  }
+  next_attempt_us = NEVER;
+}
+
+void Connector::Finish(size_t index, bool connected, const std::string& why,
+                       uint64_t now_us) {
+  Attempt& attempt = attempts[index];
+  attempt.finished_us = now_us - start_us;
+  if(connected) {
+    attempt.state = Attempt::State::CONNECTED;
+    winner = index;
+    done = true;
+    /* the winner stays registered until TakeSock */
+    for(size_t n = 0; n < socks.size(); ++n) {
+      if(n == index) continue;
+      if(attempts[n].state == Attempt::State::CONNECTING) {
+        attempts[n].state = Attempt::State::ABANDONED;
+        attempts[n].finished_us = now_us - start_us;
+        poller->Unregister(socks[n]);
+        socks[n].Close();
+      }
+    }
+    next_attempt_us = NEVER;
+    return;
+  }
+  attempt.state = Attempt::State::FAILED;
+  attempt.error = why;
+  if(socks[index]) {
+    poller->Unregister(socks[index]);
+    socks[index].Close();
+  }
+  bool any_left = next_attempt < attempts.size();
+  for(auto& other : attempts)
+    if(other.state == Attempt::State::CONNECTING) any_left = true;
+  if(!any_left) {
+    done = true;
+    /* the most informative error is usually the first address's */
+    error = attempts[0].error.empty() ? why : attempts[0].error;
+  }
+}
+
+void Connector::Abandon() {
+  for(size_t n = 0; n < socks.size(); ++n) {
+    if(!socks[n]) continue;
+    if(poller) poller->Unregister(socks[n]);
+    socks[n].Close();
+    if(attempts[n].state == Attempt::State::CONNECTING)
+      attempts[n].state = Attempt::State::ABANDONED;
+  }
+  poller = nullptr;
+  next_attempt_us = NEVER;
+}
+
+bool Connector::HandleEvent(const Poller::Event& event, uint64_t now_us) {
+  if(event.userdata != this || socks.empty()) return false;
+  size_t index = static_cast<SockStream*>(event.sock) - socks.data();
+  if(index >= socks.size()) return false;
+  if(done || attempts[index].state != Attempt::State::CONNECTING)
+    return true;
+  std::string why;
+  if(socks[index].HasError(why)) {
+    Finish(index, false, "Could not connect to "
+           + attempts[index].address.ToLongString() + ": " + why, now_us);
+    /* don't wait out the delay when we already know this one's dead */
+    if(!done) StartNext(now_us);
+  }
+  else Finish(index, true, why, now_us);
+  return true;
+}
+
+void Connector::Update(uint64_t now_us) {
+  if(done || !poller) return;
+  if(now_us - start_us >= timeout_us) {
+    for(size_t n = 0; n < attempts.size(); ++n) {
+      if(attempts[n].state == Attempt::State::CONNECTING) {
+        attempts[n].state = Attempt::State::FAILED;
+        attempts[n].finished_us = now_us - start_us;
+        attempts[n].error = "Timed out";
+        poller->Unregister(socks[n]);
+        socks[n].Close();
+      }
+    }
+    done = true;
+    error = "Timed out connecting to "
+      + attempts[0].address.ToLongString();
+    next_attempt_us = NEVER;
+    return;
+  }
+  if(now_us >= next_attempt_us) StartNext(now_us);
+}
+
+size_t Connector::GetTimeout(uint64_t now_us) const {
+  if(done) return ~(size_t)0;
+  uint64_t deadline = start_us + timeout_us;
+  if(next_attempt_us < deadline) deadline = next_attempt_us;
+  if(deadline <= now_us) return 0;
+  return deadline - now_us;
+}
+
+bool Connector::TakeSock(SockStream& sock_out) {
+  if(winner == NOBODY || !socks[winner]) return false;
+  if(poller) poller->Unregister(socks[winner]);
+  sock_out = std::move(socks[winner]);
+  return true;
+}
+
+const Address* Connector::GetConnectedAddress() const {
+  return winner == NOBODY ? nullptr : &attempts[winner].address;
+}
+
+bool Connector::Run(std::string& error_out,
+                    const std::forward_list<Address>& addresses,
+                    SockStream& sock_out) {
+  Poller poller;
+  if(!Start(error_out, addresses, poller, TimerWheel::Now())) return false;
+  while(!done) {
+    uint64_t now = TimerWheel::Now();
+    for(auto& event : poller.Wait(GetTimeout(now)))
+      HandleEvent(event, TimerWheel::Now());
+    Update(TimerWheel::Now());
+  }
+  bool ret = TakeSock(sock_out);
+  if(!ret) error_out = error;
+  /* the Poller's about to go away */
+  Abandon();
+  return ret;
+}
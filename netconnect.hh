@@ -0,0 +1,94 @@
+#ifndef NETCONNECTHH
+#define NETCONNECTHH
+
+#include "netsock.hh"
+
+namespace Net {
+  /*
+    "Happy Eyeballs" (RFC 8305) connecting: instead of trying each address
+    from ResolveHost in turn, and waiting out a dead IPv6 route before ever
+    trying IPv4, starts a new non-blocking connect every attempt_delay_us
+    (alternating address families, starting with whichever ResolveHost put
+    first) until one succeeds. The first to connect wins; the rest are
+    closed. An attempt that fails outright starts the next one immediately.
+    Drive it from your own readiness loop: Start registers the attempts
+    with your Poller (with this as userdata), so pass it every Event whose
+    userdata is this, and call Update whenever your Wait returns (wait no
+    longer than GetTimeout). Or, if you don't mind blocking, just call Run.
+    Times are in microseconds, on TimerWheel::Now()'s clock.
+  */
+  class Connector {
+  public:
+    static const uint64_t DEFAULT_ATTEMPT_DELAY_US = 250000;
+    static const uint64_t DEFAULT_TIMEOUT_US = 10000000;
+    struct Attempt {
+      enum class State : uint8_t {
+        PENDING, // not started (yet, or at all)
+        CONNECTING,
+        CONNECTED, // the winner
+        FAILED,
+        ABANDONED, // someone else won first
+      };
+      Address address;
+      State state;
+      /* relative to Start; ~0 if it never started or never finished */
+      uint64_t started_us, finished_us;
+      /* why it FAILED */
+      std::string error;
+    };
+  private:
+    std::vector<Attempt> attempts;
+    /* parallel to attempts; never resized after Start, since the Poller
+       holds pointers into it */
+    std::vector<SockStream> socks;
+    Poller* poller;
+    uint64_t attempt_delay_us, timeout_us;
+    uint64_t start_us, next_attempt_us;
+    size_t next_attempt;
+    size_t winner;
+    bool done;
+    std::string error;
+    void StartNext(uint64_t now_us);
+    void Finish(size_t index, bool connected, const std::string& why,
+                uint64_t now_us);
+    void Abandon();
+    Connector(const Connector&) = delete;
+    Connector& operator=(const Connector&) = delete;
+  public:
+    Connector(uint64_t attempt_delay_us = DEFAULT_ATTEMPT_DELAY_US,
+              uint64_t timeout_us = DEFAULT_TIMEOUT_US);
+    ~Connector();
+    /* Starts the first attempt (and, if it fails immediately, the next,
+       and so on). Returns false only if there are no addresses; the
+       Connector may already be done by the time it returns. */
+    bool Start(std::string& error_out,
+               const std::forward_list<Address>& addresses, Poller& poller,
+               uint64_t now_us);
+    /* Returns false if the Event wasn't for one of our attempts. */
+    bool HandleEvent(const Poller::Event& event, uint64_t now_us);
+    /* Starts the next attempt if it's due, and gives up if we've run out of
+       time. */
+    void Update(uint64_t now_us);
+    /* how long to wait, from now_us, before the next call to Update */
+    size_t GetTimeout(uint64_t now_us) const;
+    inline bool IsDone() const { return done; }
+    inline bool IsConnected() const { return winner != ~(size_t)0; }
+    /* Once IsConnected, moves the winning connection into sock_out (and
+       unregisters it from the Poller). Only works once. */
+    bool TakeSock(SockStream& sock_out);
+    /* why we failed, once IsDone and not IsConnected */
+    inline const std::string& GetError() const { return error; }
+    /* every address, in the order they were (or would have been) tried */
+    inline const std::vector<Attempt>& GetAttempts() const
+    { return attempts; }
+    /* the Address we connected to, if IsConnected */
+    const Address* GetConnectedAddress() const;
+    /* Does the whole thing with a private Poller, blocking until it
+       connects or times out. */
+    bool Run(std::string& error_out,
+             const std::forward_list<Address>& addresses,
+             SockStream& sock_out);
+  };
+}
+
+#endif
@@ -0,0 +1,122 @@
+#include "netfile.hh"
+#include "io.hh"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#if __WIN32__
+# include <io.h>
+# include <windows.h>
+#endif
+
+using namespace Net;
+
+FileSender::FileSender() : fd(-1), offset(0), remaining(0) {}
+
+FileSender::FileSender(FileSender&& other)
+  : fd(other.fd), offset(other.offset), remaining(other.remaining) {
+  other.fd = -1;
+  other.remaining = 0;
+}
+
+FileSender& FileSender::operator=(FileSender&& other) {
+  if(&other == this) return *this;
+  Close();
+  fd = other.fd;
+  offset = other.offset;
+  remaining = other.remaining;
+  other.fd = -1;
+  other.remaining = 0;
+  return *this;
+}
+
+FileSender::~FileSender() {
+  Close();
+}
+
+void FileSender::Close() {
+  if(fd >= 0) {
+#if __WIN32__
+    _close(fd);
+#else
+    close(fd);
+#endif
+    fd = -1;
+  }
+  offset = 0;
+  remaining = 0;
+}
+
+bool FileSender::OpenPath(std::string& error_out, const std::string& path,
+                          uint64_t offset, uint64_t len) {
+  Close();
+#if __WIN32__
+  int wide_length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1,
+                                        NULL, 0);
+  std::unique_ptr<WCHAR[]> wide_path(new WCHAR[wide_length]);
+  MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, wide_path.get(),
+                      wide_length);
+  fd = _wopen(wide_path.get(), _O_RDONLY|_O_BINARY);
+#else
+  do {
+    fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+  } while(fd < 0 && errno == EINTR);
+#endif
+  if(fd < 0) {
+    error_out = path + ": " + strerror(errno);
+    return false;
+  }
+#if __WIN32__
+  struct _stati64 st;
+  if(_fstati64(fd, &st)) {
+#else
+  struct stat st;
+  if(fstat(fd, &st)) {
+#endif
+    error_out = path + ": " + strerror(errno);
+    Close();
+    return false;
+  }
+  uint64_t size = st.st_size;
+  if(offset > size || (len != ~(uint64_t)0 && len > size - offset)) {
+    error_out = path + ": Range is beyond the end of the file";
+    Close();
+    return false;
+  }
+  this->offset = offset;
+  remaining = len == ~(uint64_t)0 ? size - offset : len;
+#if __linux__
+  /* we're going to read it once, front to back */
+  posix_fadvise(fd, offset, remaining, POSIX_FADV_SEQUENTIAL);
+#endif
+  return true;
+}
+
+bool FileSender::OpenDataFile(std::string& error_out, const std::string& path,
+                              uint64_t offset, uint64_t len) {
+  /* GetDataFilePath would die */
+  if(!IO::IsLegalDataPath(path)) {
+    Close();
+    error_out = "Illegal data file path: " + path;
+    return false;
+  }
+  return OpenPath(error_out, IO::GetDataFilePath(path), offset, len);
+}
+
+bool FileSender::OpenRawPath(std::string& error_out, const std::string& path,
+                             uint64_t offset, uint64_t len) {
+  return OpenPath(error_out, path, offset, len);
+}
+
+IOResult FileSender::Send(std::string& error_out, SockStream& sock) {
+  ErrorCode error;
+  IOResult result = Send(error, sock);
+  if(result == IOResult::ERROR || result == IOResult::CONNECTION_CLOSED)
+    error_out = error.ToString();
+  return result;
+}
+
+IOResult FileSender::Send(ErrorCode& error_out, SockStream& sock) {
+  /* (nothing is ever remaining if nothing's open) */
+  if(remaining == 0) return IOResult::OKAY;
+  return sock.SendFile(error_out, fd, offset, remaining);
+}
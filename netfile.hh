@@ -0,0 +1,51 @@
+#ifndef NETFILEHH
+#define NETFILEHH
+
+#include "netsock.hh"
+
+namespace Net {
+  /*
+    Streams a file, or a range of one, to a SockStream with
+    SockStream::SendFile, keeping track of how far it's got. Call Send
+    whenever the socket is writable until IsDone(); a WOULD_BLOCK just means
+    to come back later.
+    Owns the file descriptor; the SockStream belongs to you, and any number
+    of FileSenders may take turns with it (one after another).
+  */
+  class FileSender {
+    int fd;
+    uint64_t offset, remaining;
+    bool OpenPath(std::string& error_out, const std::string& path,
+                  uint64_t offset, uint64_t len);
+    FileSender(const FileSender&) = delete;
+    FileSender& operator=(const FileSender&) = delete;
+  public:
+    FileSender();
+    FileSender(FileSender&& other);
+    FileSender& operator=(FileSender&& other);
+    ~FileSender();
+    /* Opens a file from the Data directory, as IO::OpenDataFileForRead
+       would find it. Sends len bytes starting at offset; a len of ~0 means
+       everything after offset. Returns false if the path is illegal (see
+       IO::IsLegalDataPath; safe to pass a name that came from a client),
+       the file can't be opened, or the range isn't entirely within it. */
+    bool OpenDataFile(std::string& error_out, const std::string& path,
+                      uint64_t offset = 0, uint64_t len = ~(uint64_t)0);
+    /* Same, for any path. (Only for tools!) */
+    bool OpenRawPath(std::string& error_out, const std::string& path,
+                     uint64_t offset = 0, uint64_t len = ~(uint64_t)0);
+    /* Sends as much as the socket will take. Returns OKAY when everything's
+       been sent. */
+    IOResult Send(std::string& error_out, SockStream& sock);
+    IOResult Send(ErrorCode& error_out, SockStream& sock);
+    inline bool IsOpen() const { return fd >= 0; }
+    inline bool IsDone() const { return remaining == 0; }
+    /* where in the file the next byte will come from */
+    inline uint64_t GetOffset() const { return offset; }
+    inline uint64_t GetRemaining() const { return remaining; }
+    /* safe to call if nothing's open */
+    void Close();
+  };
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef NETINTERNALHH
+#define NETINTERNALHH
+
+/*
+  Helpers shared by the .cc files that implement Socks (netsock.cc,
+  netlocal.cc, netshm.cc). Not part of Net's interface; don't include it
+  from a header.
+*/
+
+#include "netsock.hh"
+
+#if !defined(TEG_NO_NET_STATS)
+# define HAVE_NET_STATS 1
+#endif
+
+namespace Net {
+  namespace {
+    /* records a failure for the ErrorCode overloads */
+    inline IOResult fail(ErrorCode& error_out, IOResult result,
+                         ErrorCode::Op op, int err) {
+      error_out.result = result;
+      error_out.op = op;
+      error_out.err = err;
+      return result;
+    }
+    /* turns the result of an ErrorCode overload into the result of the
+       equivalent std::string overload */
+    inline IOResult describe(std::string& error_out, IOResult result,
+                             const ErrorCode& error,
+                             const Address* address = nullptr) {
+      if(result == IOResult::ERROR || result == IOResult::CONNECTION_CLOSED)
+        error_out = error.ToString(address);
+      return result;
+    }
+#if !__WIN32__
+    /* makes an eventfd readable, for waking whoever's polling it */
+    inline void poke_eventfd(int wake) {
+      uint64_t one = 1;
+      /* can only fail if the count is absurdly high, i.e. already readable */
+      if(write(wake, &one, sizeof(one))) {}
+    }
+#endif
+    /* Counts one IO call in the NetStats (and the socket's SockStats, if it
+       has one), and times it if LatencyHistograms are on. Every way out of
+       the call should go through Done. */
+    class IOProbe {
+#if HAVE_NET_STATS
+      SockStats* stats;
+      bool send;
+      uint64_t start_ns;
+    public:
+      inline IOProbe(SockStats* stats, bool send)
+        : stats(stats), send(send),
+          start_ns(LatencyHistogram::IsEnabled() ? LatencyHistogram::Now()
+                   : 0) {}
+      inline void Interrupted() { CountInterrupted(stats); }
+      inline IOResult Done(IOResult result, uint64_t bytes = 0,
+                           uint64_t packets = 1) {
+        CountIO(stats, send, result, bytes, packets, start_ns);
+        return result;
+      }
+#else
+    public:
+      inline IOProbe(SockStats*, bool) {}
+      inline void Interrupted() {}
+      inline IOResult Done(IOResult result, uint64_t = 0, uint64_t = 1) {
+        return result;
+      }
+#endif
+    };
+  }
+}
+#define PROBE_SEND true
+#define PROBE_RECEIVE false
+
+#endif
@@ -0,0 +1,293 @@
+#include "netlocal.hh"
+#include "netinternal.hh"
+
+#include <map>
+#include <mutex>
+
+#if __linux__ && !defined(TEG_NO_EVENTFD)
+# define HAVE_EVENTFD 1
+# include <sys/eventfd.h>
+#endif
+
+using namespace Net;
+
+/* makes a wake Sock readable */
+static void poke(SOCKET wake) {
+#if HAVE_EVENTFD
+  poke_eventfd(wake);
+#else
+  send(wake, "", 1, 0);
+#endif
+}
+
+/*
+  Each end has its own wake Sock, which the other end pokes when it sends
+  something while this end was waiting. "waiting" is set by Receive when it
+  finds its ring empty; the fences make sure that either the sender sees it
+  or the receiver sees the new datagram, never neither.
+*/
+struct Net::LocalLink {
+  std::unique_ptr<SPSCPacketQueue> rings[2];
+  std::atomic<bool> waiting[2];
+  std::atomic<bool> closed[2];
+  bool loop;
+  /* guards wake, so an end can't close its wake Sock out from under a
+     sender */
+  std::mutex lock;
+  SOCKET wake[2];
+  LocalLink(size_t capacity, size_t packet_size, bool loop) : loop(loop) {
+    for(int side = 0; side < 2; ++side) {
+      if(side == 0 || !loop)
+        rings[side].reset(new SPSCPacketQueue(capacity, packet_size));
+      waiting[side].store(true, std::memory_order_relaxed);
+      closed[side].store(false, std::memory_order_relaxed);
+      wake[side] = INVALID_SOCKET;
+    }
+  }
+  inline int Peer(int side) const { return loop ? side : side ^ 1; }
+  void Poke(int side) {
+    std::lock_guard<std::mutex> guard(lock);
+    if(wake[side] != INVALID_SOCKET) poke(wake[side]);
+  }
+};
+
+namespace {
+  /* LocalServerSocks, by port */
+  std::mutex& registry_lock() {
+    static std::mutex ret;
+    return ret;
+  }
+  std::map<uint16_t, LocalServerSock*>& registry() {
+    static std::map<uint16_t, LocalServerSock*> ret;
+    return ret;
+  }
+}
+
+bool LocalSock::InitWake(std::string& error_out) {
+#if HAVE_EVENTFD
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(fd < 0) {
+    error_out = std::string("Could not create eventfd: ") + strerror(errno);
+    return false;
+  }
+  Become(fd);
+  return true;
+#else
+  SockDgram loop;
+  if(loop.MakeLoop(error_out) != IOResult::OKAY) return false;
+  Sock::operator=(std::move(loop));
+  SetBlocking(false);
+  return true;
+#endif
+}
+
+void LocalSock::DrainWake() {
+#if HAVE_EVENTFD
+  uint64_t count;
+  if(read(sock, &count, sizeof(count))) {}
+#else
+  char buf[64];
+  while(recv(sock, buf, sizeof(buf), 0) > 0) {}
+#endif
+}
+
+LocalSockDgram::LocalSockDgram(LocalSockDgram&& other)
+  : LocalSock(std::move(other)), link(std::move(other.link)),
+    side(other.side) {}
+
+LocalSockDgram& LocalSockDgram::operator=(LocalSockDgram&& other) {
+  if(&other == this) return *this;
+  Close();
+  Sock::operator=(std::move(other));
+  link = std::move(other.link);
+  side = other.side;
+  return *this;
+}
+
+void LocalSockDgram::Close() {
+  if(link) {
+    link->closed[side].store(true);
+    {
+      std::lock_guard<std::mutex> guard(link->lock);
+      link->wake[side] = INVALID_SOCKET;
+    }
+    link.reset();
+  }
+  Sock::Close();
+}
+
+bool LocalSockDgram::MakePair(std::string& error_out,
+                              LocalSockDgram& a, LocalSockDgram& b,
+                              size_t capacity, size_t packet_size) {
+  a.Close();
+  b.Close();
+  if(!a.InitWake(error_out)) return false;
+  if(!b.InitWake(error_out)) {
+    a.Close();
+    return false;
+  }
+  std::shared_ptr<LocalLink> link(new LocalLink(capacity, packet_size,
+                                                false));
+  link->wake[0] = a.sock;
+  link->wake[1] = b.sock;
+  a.link = link;
+  a.side = 0;
+  b.link = std::move(link);
+  b.side = 1;
+  return true;
+}
+
+IOResult LocalSockDgram::MakeLoop(std::string& error_out, size_t capacity,
+                                  size_t packet_size) {
+  Close();
+  if(!InitWake(error_out)) return IOResult::ERROR;
+  link.reset(new LocalLink(capacity, packet_size, true));
+  link->wake[0] = sock;
+  side = 0;
+  return IOResult::OKAY;
+}
+
+bool LocalSockDgram::IsInProcess(const Address& address) {
+  if(!address.IsLoopback()) return false;
+  std::lock_guard<std::mutex> guard(registry_lock());
+  return registry().count(address.GetPort()) != 0;
+}
+
+IOResult LocalSockDgram::Connect(std::string& error_out,
+                                 const Address& target_address,
+                                 size_t capacity, size_t packet_size) {
+  Close();
+  if(!target_address.IsLoopback()) {
+    error_out = "Not a loopback address: " + target_address.ToString();
+    return IOResult::ERROR;
+  }
+  if(!InitWake(error_out)) return IOResult::ERROR;
+  std::lock_guard<std::mutex> guard(registry_lock());
+  auto it = registry().find(target_address.GetPort());
+  if(it == registry().end()) {
+    error_out = "No in-process server at "
+      + target_address.ToLongString();
+    Sock::Close();
+    return IOResult::ERROR;
+  }
+  LocalServerSock& server = *it->second;
+  link.reset(new LocalLink(capacity, packet_size, false));
+  link->wake[0] = sock;
+  side = 0;
+  if(server.pending.empty()) poke(server.sock);
+  server.pending.push_back(link);
+  return IOResult::OKAY;
+}
+
+IOResult LocalSockDgram::Receive(std::string& error_out,
+                                 void* buf, size_t& len_inout) {
+  ErrorCode error;
+  return describe(error_out, Receive(error, buf, len_inout), error);
+}
+
+IOResult LocalSockDgram::Receive(ErrorCode& error_out,
+                                 void* buf, size_t& len_inout) {
+  if(!link)
+    return fail(error_out, IOResult::ERROR, ErrorCode::Op::RECEIVE,
+                ErrorCode::NOT_VALID);
+  IOProbe probe(stats, PROBE_RECEIVE);
+  SPSCPacketQueue& ring = *link->rings[side];
+  DgramSlot* slot = ring.Front();
+  if(!slot) {
+    DrainWake();
+    link->waiting[side].store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    slot = ring.Front();
+    if(!slot)
+      return probe.Done(IOResult::WOULD_BLOCK);
+  }
+  /* like recv, silently truncates */
+  if(slot->len < len_inout) len_inout = slot->len;
+  memcpy(buf, slot->buf, len_inout);
+  ring.Pop();
+  return probe.Done(IOResult::OKAY, len_inout);
+}
+
+IOResult LocalSockDgram::Send(std::string& error_out,
+                              const void* buf, size_t len) {
+  ErrorCode error;
+  return describe(error_out, Send(error, buf, len), error);
+}
+
+IOResult LocalSockDgram::Send(ErrorCode& error_out,
+                              const void* buf, size_t len) {
+  if(!link)
+    return fail(error_out, IOResult::ERROR, ErrorCode::Op::SEND,
+                ErrorCode::NOT_VALID);
+  IOProbe probe(stats, PROBE_SEND);
+  int peer = link->Peer(side);
+  if(link->closed[peer].load(std::memory_order_relaxed))
+    return probe.Done(fail(error_out, IOResult::CONNECTION_CLOSED,
+                           ErrorCode::Op::SEND, ECONNREFUSED));
+  SPSCPacketQueue& ring = *link->rings[peer];
+  if(len > ring.GetPacketSize())
+    return probe.Done(fail(error_out, IOResult::MSGSIZE, ErrorCode::Op::SEND,
+                           EMSGSIZE));
+  if(!ring.Push(buf, len, Address()))
+    return probe.Done(IOResult::WOULD_BLOCK);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(link->waiting[peer].load(std::memory_order_relaxed)
+     && link->waiting[peer].exchange(false))
+    link->Poke(peer);
+  return probe.Done(IOResult::OKAY, len);
+}
+
+bool LocalServerSock::Bind(std::string& error_out, uint16_t port) {
+  Close();
+  if(port == 0) {
+    error_out = "LocalServerSock needs a specific port";
+    return false;
+  }
+  if(!InitWake(error_out)) return false;
+  std::lock_guard<std::mutex> guard(registry_lock());
+  if(!registry().insert(std::make_pair(port, this)).second) {
+    error_out = TEG::format("Port %u is already bound in this process",
+                            (unsigned)port);
+    Sock::Close();
+    return false;
+  }
+  this->port = port;
+  return true;
+}
+
+bool LocalServerSock::Accept(std::string& error_out,
+                             LocalSockDgram& sock_out) {
+  std::shared_ptr<LocalLink> link;
+  {
+    std::lock_guard<std::mutex> guard(registry_lock());
+    if(pending.empty()) return false;
+    link = std::move(pending.front());
+    pending.pop_front();
+    if(pending.empty()) DrainWake();
+  }
+  sock_out.Close();
+  if(!sock_out.InitWake(error_out)) {
+    link->closed[1].store(true);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> guard(link->lock);
+    link->wake[1] = sock_out.sock;
+  }
+  sock_out.link = std::move(link);
+  sock_out.side = 1;
+  /* the client may have sent something already */
+  sock_out.link->Poke(1);
+  return true;
+}
+
+void LocalServerSock::Close() {
+  if(port != 0) {
+    std::lock_guard<std::mutex> guard(registry_lock());
+    registry().erase(port);
+    for(auto& link : pending) link->closed[1].store(true);
+    pending.clear();
+    port = 0;
+  }
+  Sock::Close();
+}
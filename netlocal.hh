@@ -0,0 +1,107 @@
+#ifndef NETLOCALHH
+#define NETLOCALHH
+
+#include "netsock.hh"
+#include "netqueue.hh"
+
+#include <deque>
+#include <memory>
+
+namespace Net {
+  struct LocalLink;
+  /*
+    In-process datagram "sockets", for single player and for a listen
+    server's own client: the same Send/Receive/IOResult contract as
+    SockDgram, but the datagrams go through a pair of lock-free rings
+    (SPSCPacketQueue) instead of the kernel's network stack. Each end may be
+    used from a different thread.
+    They're still Socks, so they can be registered with a Poller (not
+    Select) and show up as readable like anything else. On Linux the
+    readable part is an eventfd; elsewhere, a MakeLoop socket. It's only
+    poked when the receiving side has run dry, so a busy link costs no
+    system calls at all.
+    Differences from SockDgram:
+    - A full ring makes Send return WOULD_BLOCK, rather than silently
+      dropping the datagram.
+    - Datagrams larger than the link's packet size get MSGSIZE.
+    - Sending to an end that's been closed gets CONNECTION_CLOSED.
+    - There's no Address. A LocalServerSock hands you a LocalSockDgram per
+      client, and you tell them apart by which one it is.
+  */
+  class LocalSock : public Sock {
+  protected:
+    bool InitWake(std::string& error_out);
+    /* clears readability */
+    void DrainWake();
+  };
+  class LocalSockDgram : public LocalSock {
+    friend class LocalServerSock;
+    std::shared_ptr<LocalLink> link;
+    int side;
+    LocalSockDgram(const LocalSockDgram&) = delete;
+    LocalSockDgram& operator=(const LocalSockDgram&) = delete;
+  public:
+    static const size_t DEFAULT_CAPACITY = 256;
+    static const size_t DEFAULT_PACKET_SIZE = 2048;
+    inline LocalSockDgram() : side(0) {}
+    inline ~LocalSockDgram() { Close(); }
+    LocalSockDgram(LocalSockDgram&& other);
+    LocalSockDgram& operator=(LocalSockDgram&& other);
+    /* Connects to the LocalServerSock bound to address's port, if address
+       is loopback and there is one in this process (see IsInProcess);
+       otherwise, returns ERROR, and you should use a SockDgram. Only
+       returns ERROR or OKAY. */
+    IOResult Connect(std::string& error_out, const Address& target_address,
+                     size_t capacity = DEFAULT_CAPACITY,
+                     size_t packet_size = DEFAULT_PACKET_SIZE);
+    /* a link that talks to itself, like SockDgram::MakeLoop */
+    IOResult MakeLoop(std::string& error_out,
+                      size_t capacity = DEFAULT_CAPACITY,
+                      size_t packet_size = DEFAULT_PACKET_SIZE);
+    /* two ends of a new link, with no LocalServerSock involved */
+    static bool MakePair(std::string& error_out,
+                         LocalSockDgram& a, LocalSockDgram& b,
+                         size_t capacity = DEFAULT_CAPACITY,
+                         size_t packet_size = DEFAULT_PACKET_SIZE);
+    /* true if Connect to this Address would find a LocalServerSock */
+    static bool IsInProcess(const Address& address);
+    IOResult Receive(std::string& error_out,
+                     void* buf, size_t& len_inout);
+    IOResult Receive(ErrorCode& error_out,
+                     void* buf, size_t& len_inout);
+    IOResult Send(std::string& error_out,
+                  const void* buf, size_t len);
+    IOResult Send(ErrorCode& error_out,
+                  const void* buf, size_t len);
+    /* the other end will get CONNECTION_CLOSED on its next Send */
+    void Close();
+  };
+  /*
+    Claims a loopback port (for both IPv4 and IPv6) in this process, so that
+    LocalSockDgram::Connect to it gets an in-process link. It doesn't touch
+    the real port; a listen server typically binds a ServerSockDgram to the
+    same port for remote clients, and its own client Connects here instead.
+    Readable whenever a connection is waiting to be Accepted. Not movable,
+    since connecting clients need to find it.
+  */
+  class LocalServerSock : public LocalSock {
+    friend class LocalSockDgram;
+    uint16_t port;
+    /* guarded by the registry's lock */
+    std::deque<std::shared_ptr<LocalLink>> pending;
+    LocalServerSock(LocalServerSock&&) = delete;
+    LocalServerSock& operator=(LocalServerSock&&) = delete;
+  public:
+    inline LocalServerSock() : port(0) {}
+    inline ~LocalServerSock() { Close(); }
+    /* fails if another LocalServerSock has the port */
+    bool Bind(std::string& error_out, uint16_t port);
+    /* returns false if nobody's waiting */
+    bool Accept(std::string& error_out, LocalSockDgram& sock_out);
+    inline uint16_t GetPort() const { return port; }
+    /* connections that weren't Accepted yet are closed */
+    void Close();
+  };
+}
+
+#endif
@@ -0,0 +1,257 @@
+#include "netpace.hh"
+
+#include <algorithm>
+
+using namespace Net;
+
+#define NEVER (~(uint64_t)0)
+#define SCALE 1000000
+
+/* don't bother looking for idle peers until there are this many */
+#define MIN_PRUNE 64
+
+TokenBucket::TokenBucket(uint64_t rate, size_t burst, uint64_t now_us) {
+  SetRate(rate, burst, now_us);
+}
+
+void TokenBucket::SetRate(uint64_t rate, size_t burst, uint64_t now_us) {
+  this->rate = rate;
+  this->burst = burst;
+  tokens = (int64_t)burst * SCALE;
+  last_us = now_us;
+}
+
+void TokenBucket::Refill(uint64_t now_us) {
+  if(now_us <= last_us) return;
+  uint64_t elapsed = now_us - last_us;
+  last_us = now_us;
+  if(!rate) return;
+  /* careful not to overflow after a long idle spell */
+  if(tokens >= (int64_t)burst * SCALE) return;
+  uint64_t deficit = (int64_t)burst * SCALE - tokens;
+  if(elapsed >= deficit / rate + 1) tokens = (int64_t)burst * SCALE;
+  else tokens += (int64_t)(rate * elapsed);
+}
+
+bool TokenBucket::CanSpend(size_t bytes) const {
+  if(!rate) return true;
+  if(bytes > burst) bytes = burst;
+  return tokens >= (int64_t)bytes * SCALE;
+}
+
+void TokenBucket::Spend(size_t bytes) {
+  if(!rate) return;
+  tokens -= (int64_t)bytes * SCALE;
+}
+
+uint64_t TokenBucket::GetReadyTime(size_t bytes, uint64_t now_us) const {
+  if(CanSpend(bytes)) return now_us;
+  if(bytes > burst) bytes = burst;
+  uint64_t need = (int64_t)bytes * SCALE - tokens;
+  uint64_t ready = last_us + (need + rate - 1) / rate;
+  return ready > now_us ? ready : now_us;
+}
+
+Pacer::Pacer(ServerSockDgram& sock, TimerWheel& wheel,
+             size_t max_queued_bytes)
+  : sock(sock), wheel(wheel), peer_rate(0), peer_burst(0),
+    max_queued_bytes(max_queued_bytes), prune_at(MIN_PRUNE),
+    next_us(NEVER) {
+  memset(&stats, 0, sizeof(stats));
+  timer.callback = [this]{ Flush(); };
+}
+
+bool Pacer::SetGlobalRate(std::string& error_out, uint64_t bytes_per_second,
+                          size_t burst) {
+  global.SetRate(bytes_per_second, burst, TimerWheel::Now());
+  return sock.SetMaxPacingRate(error_out, bytes_per_second);
+}
+
+void Pacer::SetPeerRate(uint64_t bytes_per_second, size_t burst) {
+  peer_rate = bytes_per_second;
+  peer_burst = burst;
+  uint64_t now = TimerWheel::Now();
+  for(auto& p : peers)
+    if(!p.second.custom) p.second.bucket.SetRate(peer_rate, peer_burst, now);
+}
+
+void Pacer::SetPeerRate(const Address& address, uint64_t bytes_per_second,
+                        size_t burst) {
+  uint64_t now = TimerWheel::Now();
+  Peer& peer = GetPeer(address, now);
+  peer.bucket.SetRate(bytes_per_second, burst, now);
+  peer.custom = true;
+}
+
+Pacer::Peer& Pacer::GetPeer(const Address& address, uint64_t now_us) {
+  Endpoint endpoint(address);
+  auto it = peers.find(endpoint);
+  if(it != peers.end()) return it->second;
+  if(peers.size() >= prune_at) Prune(now_us);
+  Peer& peer = peers[endpoint];
+  peer.address = address;
+  peer.bucket.SetRate(peer_rate, peer_burst, now_us);
+  peer.queued_bytes = 0;
+  peer.custom = false;
+  return peer;
+}
+
+void Pacer::Prune(uint64_t now_us) {
+  for(auto it = peers.begin(); it != peers.end();) {
+    Peer& peer = it->second;
+    peer.bucket.Refill(now_us);
+    /* a peer with a full bucket would get the same treatment if it were
+       new, so there's no need to remember it */
+    if(!peer.custom && peer.queue.empty() && peer.bucket.IsFull())
+      it = peers.erase(it);
+    else ++it;
+  }
+  prune_at = peers.size() * 2;
+  if(prune_at < MIN_PRUNE) prune_at = MIN_PRUNE;
+}
+
+void Pacer::RemovePeer(const Address& address) {
+  auto it = peers.find(Endpoint(address));
+  if(it == peers.end()) return;
+  Peer& peer = it->second;
+  if(!peer.queue.empty()) {
+    stats.dropped += peer.queue.size();
+    stats.queued_packets -= peer.queue.size();
+    stats.queued_bytes -= peer.queued_bytes;
+    for(auto ait = active.begin(); ait != active.end(); ++ait) {
+      if(*ait == it->first) {
+        active.erase(ait);
+        break;
+      }
+    }
+  }
+  peers.erase(it);
+}
+
+IOResult Pacer::Send(std::string& error_out, const void* buf, size_t len,
+                     const Address& address) {
+  ErrorCode error;
+  IOResult result = Send(error, buf, len, address);
+  if(result == IOResult::ERROR || result == IOResult::CONNECTION_CLOSED)
+    error_out = error.ToString(&address);
+  return result;
+}
+
+IOResult Pacer::Send(ErrorCode& error_out, const void* buf, size_t len,
+                     const Address& address) {
+  uint64_t now = TimerWheel::Now();
+  Peer& peer = GetPeer(address, now);
+  peer.bucket.Refill(now);
+  global.Refill(now);
+  /* nothing may jump the queue: not this peer's, and not other peers' that
+     are waiting on the global bucket */
+  if(peer.queue.empty() && peer.bucket.CanSpend(len)
+     && (active.empty() || !global.IsLimited()) && global.CanSpend(len)) {
+    IOResult result = sock.Send(error_out, buf, len, address);
+    if(result == IOResult::OKAY) {
+      peer.bucket.Spend(len);
+      global.Spend(len);
+      ++stats.sent_immediately;
+      return result;
+    }
+    /* if the socket's full, queue it like anything else */
+    else if(result != IOResult::WOULD_BLOCK) return result;
+  }
+  if(stats.queued_bytes + len > max_queued_bytes) {
+    ++stats.dropped;
+    return IOResult::WOULD_BLOCK;
+  }
+  if(peer.queue.empty()) active.push_back(Endpoint(address));
+  peer.queue.emplace_back();
+  Packet& packet = peer.queue.back();
+  packet.data.assign(reinterpret_cast<const uint8_t*>(buf),
+                     reinterpret_cast<const uint8_t*>(buf) + len);
+  packet.queued_us = now;
+  peer.queued_bytes += len;
+  stats.queued_bytes += len;
+  ++stats.queued_packets;
+  if(stats.queued_bytes > stats.max_queued_bytes)
+    stats.max_queued_bytes = stats.queued_bytes;
+  /* this one may be due before whatever the timer's waiting for */
+  uint64_t ready = peer.queue.size() > 1 ? NEVER
+    : std::max(peer.bucket.GetReadyTime(len, now),
+               global.GetReadyTime(len, now));
+  if(!timer.IsScheduled()) Reschedule(now);
+  else if(ready < next_us) {
+    next_us = ready;
+    wheel.Schedule(timer, next_us);
+  }
+  return IOResult::OKAY;
+}
+
+void Pacer::Flush(uint64_t now_us) {
+  timer.Cancel();
+  global.Refill(now_us);
+  bool progress = true, socket_full = false;
+  /* one datagram per peer per pass, until nobody can send */
+  while(progress && !socket_full && !active.empty()) {
+    progress = false;
+    for(size_t n = active.size(); n > 0; --n) {
+      Endpoint endpoint = active.front();
+      Peer& peer = peers[endpoint];
+      Packet& packet = peer.queue.front();
+      size_t len = packet.data.size();
+      peer.bucket.Refill(now_us);
+      if(!peer.bucket.CanSpend(len)) {
+        active.pop_front();
+        active.push_back(endpoint);
+        continue;
+      }
+      /* everyone keeps their place until there are global tokens */
+      if(!global.CanSpend(len)) {
+        progress = false;
+        break;
+      }
+      ErrorCode error;
+      IOResult result = sock.Send(error, packet.data.data(), len,
+                                  peer.address);
+      if(result == IOResult::WOULD_BLOCK) {
+        socket_full = true;
+        break;
+      }
+      if(result == IOResult::OKAY) {
+        peer.bucket.Spend(len);
+        global.Spend(len);
+        ++stats.sent_paced;
+        stats.queued_us += now_us - packet.queued_us;
+      }
+      else ++stats.errors;
+      progress = true;
+      peer.queued_bytes -= len;
+      stats.queued_bytes -= len;
+      --stats.queued_packets;
+      peer.queue.pop_front();
+      active.pop_front();
+      if(!peer.queue.empty()) active.push_back(endpoint);
+    }
+  }
+  if(socket_full) {
+    next_us = now_us + wheel.GetTickLength();
+    wheel.Schedule(timer, next_us);
+  }
+  else Reschedule(now_us);
+}
+
+void Pacer::Reschedule(uint64_t now_us) {
+  uint64_t next = NEVER;
+  for(auto& endpoint : active) {
+    Peer& peer = peers[endpoint];
+    size_t len = peer.queue.front().data.size();
+    uint64_t ready = peer.bucket.GetReadyTime(len, now_us);
+    uint64_t global_ready = global.GetReadyTime(len, now_us);
+    if(global_ready > ready) ready = global_ready;
+    if(ready < next) next = ready;
+  }
+  next_us = next;
+  if(next != NEVER) wheel.Schedule(timer, next);
+}
+
+size_t Pacer::GetQueuedBytes(const Address& address) const {
+  auto it = peers.find(Endpoint(address));
+  return it == peers.end() ? 0 : it->second.queued_bytes;
+}
@@ -0,0 +1,128 @@
+#ifndef NETPACEHH
+#define NETPACEHH
+
+#include "nettimer.hh"
+
+#include <deque>
+
+namespace Net {
+  /*
+    Refills at rate bytes per second, up to burst bytes. A rate of 0 means
+    unlimited. A datagram bigger than burst may still be sent once the
+    bucket is full, leaving it in debt. Times are in microseconds.
+  */
+  class TokenBucket {
+    uint64_t rate, burst;
+    /* in millionths of a byte, so that slow refills aren't rounded away;
+       negative when in debt */
+    int64_t tokens;
+    uint64_t last_us;
+  public:
+    TokenBucket(uint64_t rate = 0, size_t burst = 0, uint64_t now_us = 0);
+    /* starts out full */
+    void SetRate(uint64_t rate, size_t burst, uint64_t now_us);
+    void Refill(uint64_t now_us);
+    /* Refill first */
+    bool CanSpend(size_t bytes) const;
+    void Spend(size_t bytes);
+    /* when CanSpend(bytes) will be true; now_us if it already is */
+    uint64_t GetReadyTime(size_t bytes, uint64_t now_us) const;
+    inline bool IsFull() const { return tokens >= (int64_t)burst * 1000000; }
+    inline bool IsLimited() const { return rate != 0; }
+    inline uint64_t GetRate() const { return rate; }
+    inline uint64_t GetBurst() const { return burst; }
+  };
+  /*
+    Paces a ServerSockDgram's output, so that a burst of sends (a snapshot
+    to every client at the top of a tick, say) is spread out instead of
+    overflowing the NIC's queue and being dropped. Each peer has its own
+    TokenBucket, and there's a global one over them all. A datagram that's
+    within budget, with nothing queued ahead of it, is sent immediately;
+    the rest are copied into per-peer queues and sent from a Timer on the
+    given TimerWheel as tokens come in, one datagram per peer in turn. So
+    keep calling the wheel's Advance (or Wait).
+    SetGlobalRate also asks the kernel to pace the socket at the same rate
+    (see Sock::SetMaxPacingRate), to smooth out what's sent within a burst.
+    Peers are forgotten once they're idle and their bucket is full, unless
+    they have a rate of their own.
+    Not thread safe; use it from the TimerWheel's thread.
+  */
+  class Pacer {
+  public:
+    static const size_t DEFAULT_MAX_QUEUED_BYTES = 1 << 20;
+    struct Stats {
+      /* right now */
+      uint64_t queued_bytes, queued_packets;
+      /* the most that's ever been queued at once */
+      uint64_t max_queued_bytes;
+      uint64_t sent_immediately, sent_paced;
+      /* turned away because the queue was full, or thrown away by
+         RemovePeer */
+      uint64_t dropped;
+      /* paced sends that failed */
+      uint64_t errors;
+      /* how long paced datagrams spent queued, in total */
+      uint64_t queued_us;
+    };
+  private:
+    struct Packet {
+      std::vector<uint8_t> data;
+      uint64_t queued_us;
+    };
+    struct Peer {
+      Address address;
+      TokenBucket bucket;
+      std::deque<Packet> queue;
+      size_t queued_bytes;
+      /* has a rate from SetPeerRate, rather than the default */
+      bool custom;
+    };
+    ServerSockDgram& sock;
+    TimerWheel& wheel;
+    Timer timer;
+    TokenBucket global;
+    uint64_t peer_rate;
+    size_t peer_burst;
+    size_t max_queued_bytes;
+    std::unordered_map<Endpoint, Peer> peers;
+    /* peers with something queued, in the order they'll next be served */
+    std::deque<Endpoint> active;
+    /* when peers gets this big, look for idle ones to forget */
+    size_t prune_at;
+    /* when the timer's set for */
+    uint64_t next_us;
+    Stats stats;
+    Peer& GetPeer(const Address& address, uint64_t now_us);
+    void Prune(uint64_t now_us);
+    void Reschedule(uint64_t now_us);
+    Pacer(const Pacer&) = delete;
+    Pacer& operator=(const Pacer&) = delete;
+  public:
+    Pacer(ServerSockDgram& sock, TimerWheel& wheel,
+          size_t max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES);
+    /* Limits everything sent through this Pacer. Returns false if the
+       kernel wouldn't pace the socket too; the limit still applies here. */
+    bool SetGlobalRate(std::string& error_out, uint64_t bytes_per_second,
+                       size_t burst);
+    /* the default for every peer without a rate of its own */
+    void SetPeerRate(uint64_t bytes_per_second, size_t burst);
+    void SetPeerRate(const Address& address, uint64_t bytes_per_second,
+                     size_t burst);
+    /* forgets a peer, and throws away anything queued for it */
+    void RemovePeer(const Address& address);
+    /* Sends now, or queues for later. OKAY if either; WOULD_BLOCK if the
+       queue is full, and the datagram was dropped; anything else is from
+       ServerSockDgram::Send. */
+    IOResult Send(ErrorCode& error_out, const void* buf, size_t len,
+                  const Address& address);
+    IOResult Send(std::string& error_out, const void* buf, size_t len,
+                  const Address& address);
+    /* sends whatever's due; the Timer calls this for you */
+    void Flush(uint64_t now_us = TimerWheel::Now());
+    inline size_t GetQueuedBytes() const { return stats.queued_bytes; }
+    size_t GetQueuedBytes(const Address& address) const;
+    inline const Stats& GetStats() const { return stats; }
+  };
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "netpmtu.hh"
+
+using namespace Net;
+
+/* stop searching once the bounds are this close together */
+#define SEARCH_GRANULARITY 16
+/* RFC 8899 MAX_PROBES */
+#define MAX_PROBE_LOSSES 3
+/* RFC 8899 PMTU_RAISE_TIMER */
+#define RAISE_INTERVAL_US 600000000ULL
+
+PathMTU::PathMTU(const Address& peer, size_t max_mtu)
+  : PathMTU(peer.GetEstimatedDgramMTU(),
+            max_mtu ? max_mtu : peer.GetEthernetDgramMTU()) {}
+
+PathMTU::PathMTU(size_t base_mtu, size_t max_mtu)
+  : base_mtu(base_mtu), max_mtu(max_mtu < base_mtu ? base_mtu : max_mtu),
+    low(base_mtu), probe_sent_us(0), raise_at_us(0) {
+  Restart();
+}
+
+void PathMTU::Restart() {
+  high = max_mtu;
+  probe_losses = 0;
+  probe_outstanding = false;
+  searching = high - low >= SEARCH_GRANULARITY;
+  probe_size = searching ? (low + high + 1) / 2 : 0;
+}
+
+size_t PathMTU::GetProbeSize(uint64_t now_us, uint64_t timeout_us) {
+  if(!searching) {
+    if(now_us < raise_at_us) return 0;
+    Restart();
+    if(!searching) {
+      raise_at_us = now_us + RAISE_INTERVAL_US;
+      return 0;
+    }
+  }
+  if(probe_outstanding) {
+    if(now_us - probe_sent_us < timeout_us) return 0;
+    probe_outstanding = false;
+    if(++probe_losses >= MAX_PROBE_LOSSES) {
+      high = probe_size - 1;
+      probe_losses = 0;
+      if(high - low < SEARCH_GRANULARITY) {
+        searching = false;
+        raise_at_us = now_us + RAISE_INTERVAL_US;
+        return 0;
+      }
+      probe_size = (low + high + 1) / 2;
+    }
+  }
+  return probe_size;
+}
+
+uint64_t PathMTU::GetNextProbeTime(uint64_t timeout_us) const {
+  if(!searching) return raise_at_us;
+  else if(probe_outstanding) return probe_sent_us + timeout_us;
+  else return 0;
+}
+
+void PathMTU::ProbeSent(size_t size, uint64_t now_us) {
+  if(!searching || size != probe_size) return;
+  probe_outstanding = true;
+  probe_sent_us = now_us;
+}
+
+void PathMTU::ProbeAcked(size_t size, uint64_t now_us) {
+  /* a late ack for a probe bigger than HandleMsgSize has since said won't
+     fit tells us nothing; believing it would leave low above high */
+  if(size > high) return;
+  if(size > low) low = size;
+  if(!searching || size != probe_size) return;
+  probe_outstanding = false;
+  probe_losses = 0;
+  if(high - low < SEARCH_GRANULARITY) {
+    searching = false;
+    raise_at_us = now_us + RAISE_INTERVAL_US;
+  }
+  else probe_size = (low + high + 1) / 2;
+}
+
+void PathMTU::HandleMsgSize(size_t size, uint64_t now_us) {
+  if(size <= base_mtu) {
+    /* nothing we can do about that */
+    return;
+  }
+  if(size <= low) {
+    /* the path got smaller; start over from the bottom */
+    low = base_mtu;
+  }
+  high = size - 1;
+  probe_outstanding = false;
+  probe_losses = 0;
+  searching = high - low >= SEARCH_GRANULARITY;
+  if(searching) probe_size = (low + high + 1) / 2;
+  else raise_at_us = now_us + RAISE_INTERVAL_US;
+}
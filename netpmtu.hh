@@ -0,0 +1,58 @@
+#ifndef NETPMTUHH
+#define NETPMTUHH
+
+#include "netsock.hh"
+
+namespace Net {
+  /*
+    Per-peer datagram path MTU discovery, in the style of RFC 8899
+    (Datagram PLPMTUD). Starts out at the peer Address's
+    GetEstimatedDgramMTU(), which is always safe, and binary searches
+    upward towards max_mtu by sending padded probe datagrams. A probe that's
+    acknowledged raises the effective MTU; a probe that's lost three times
+    lowers the search ceiling. An MSGSIZE from Send lowers the ceiling
+    immediately, and drops the effective MTU back to the safe value if
+    necessary. Once the search settles, it's repeated every ten minutes in
+    case the path has grown.
+    This only decides what sizes to probe and what MTU to use; sending
+    probes and noticing that they arrived is up to you. (Connection does
+    both, if you give it a max_mtu.) The socket should have
+    SetDontFragment(true), or probes will "succeed" by being fragmented.
+    All sizes are UDP payload sizes.
+  */
+  class PathMTU {
+    size_t base_mtu, max_mtu;
+    /* confirmed to work; never less than base_mtu */
+    size_t low;
+    /* not yet known not to work */
+    size_t high;
+    size_t probe_size;
+    uint64_t probe_sent_us, raise_at_us;
+    int probe_losses;
+    bool probe_outstanding, searching;
+    void Restart();
+  public:
+    /* max_mtu of 0 means the most that fits in an Ethernet frame */
+    PathMTU(const Address& peer, size_t max_mtu = 0);
+    PathMTU(size_t base_mtu, size_t max_mtu);
+    /* If a probe should be sent now, returns its size. Otherwise, returns 0.
+       An outstanding probe that's older than timeout_us is considered
+       lost. */
+    size_t GetProbeSize(uint64_t now_us, uint64_t timeout_us);
+    /* when GetProbeSize will next have something to say; may be in the
+       past */
+    uint64_t GetNextProbeTime(uint64_t timeout_us) const;
+    void ProbeSent(size_t size, uint64_t now_us);
+    void ProbeAcked(size_t size, uint64_t now_us);
+    /* Call when Send returns MSGSIZE for a datagram of this size (probe or
+       not). */
+    void HandleMsgSize(size_t size, uint64_t now_us);
+    /* the largest datagram currently known to be safe */
+    inline size_t GetMTU() const { return low; }
+    inline size_t GetBaseMTU() const { return base_mtu; }
+    inline size_t GetMaxMTU() const { return max_mtu; }
+    inline bool IsSearching() const { return searching; }
+  };
+}
+
+#endif
@@ -0,0 +1,256 @@
+#include "netpool.hh"
+
+#include <new>
+#include <unordered_set>
+
+using namespace Net;
+
+/* how many buffers move between a thread's cache and the shared free list
+   at once; a thread's cache holds up to twice this many */
+#define CACHE_BATCH 32
+/* how many pools each thread keeps a cache for */
+#define CACHED_POOLS 4
+/* buffers per slab */
+#define SLAB_BUFFERS 64
+#define CACHE_LINE 64
+
+static size_t round_up(size_t n) {
+  return (n + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+struct PacketBuffer::Header {
+  PacketPool* pool;
+  std::atomic<uint32_t> refs;
+  size_t len;
+  Address address;
+};
+
+/* the data follows the Header, on its own cache line */
+#define HEADER_SPACE round_up(sizeof(PacketBuffer::Header))
+
+/* IDs of pools that haven't been destroyed, so that a thread that exits
+   can tell whether its cached buffers have anywhere to go */
+static std::mutex registry_lock;
+static std::unordered_set<uint64_t>& live_pools() {
+  static std::unordered_set<uint64_t> ret;
+  return ret;
+}
+static std::atomic<uint64_t> next_pool_id(1);
+
+struct Net::PacketThreadCache {
+  struct Entry {
+    /* 0 = unused */
+    uint64_t pool_id;
+    PacketPool* pool;
+    std::vector<PacketBuffer::Header*> free;
+  };
+  Entry entries[CACHED_POOLS];
+  int next_victim;
+  PacketThreadCache() : next_victim(0) {
+    for(auto& entry : entries) entry.pool_id = 0;
+  }
+  ~PacketThreadCache() {
+    for(auto& entry : entries) Flush(entry);
+  }
+  static void Flush(Entry& entry) {
+    if(entry.pool_id == 0) return;
+    if(!entry.free.empty()) {
+      std::lock_guard<std::mutex> guard(registry_lock);
+      if(live_pools().count(entry.pool_id))
+        entry.pool->GiveToShared(entry.free.data(), entry.free.size());
+    }
+    entry.free.clear();
+    entry.pool_id = 0;
+  }
+  Entry& Get(PacketPool* pool) {
+    Entry* empty = nullptr;
+    for(auto& entry : entries) {
+      if(entry.pool_id == pool->id) return entry;
+      else if(entry.pool_id == 0 && !empty) empty = &entry;
+    }
+    Entry* ret = empty;
+    if(!ret) {
+      ret = &entries[next_victim];
+      next_victim = (next_victim + 1) % CACHED_POOLS;
+      Flush(*ret);
+    }
+    ret->pool_id = pool->id;
+    ret->pool = pool;
+    ret->free.reserve(CACHE_BATCH * 2);
+    return *ret;
+  }
+};
+
+static thread_local PacketThreadCache thread_cache;
+
+PacketBuffer::PacketBuffer(const PacketBuffer& other) : header(other.header) {
+  if(header) header->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+PacketBuffer& PacketBuffer::operator=(const PacketBuffer& other) {
+  if(other.header) other.header->refs.fetch_add(1, std::memory_order_relaxed);
+  Reset();
+  header = other.header;
+  return *this;
+}
+
+PacketBuffer& PacketBuffer::operator=(PacketBuffer&& other) {
+  if(&other == this) return *this;
+  Reset();
+  header = other.header;
+  other.header = nullptr;
+  return *this;
+}
+
+void PacketBuffer::Reset() {
+  if(!header) return;
+  if(header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    header->pool->Release(header);
+  header = nullptr;
+}
+
+uint8_t* PacketBuffer::GetData() const {
+  assert(header);
+  return reinterpret_cast<uint8_t*>(header) + HEADER_SPACE;
+}
+
+size_t PacketBuffer::GetCapacity() const {
+  assert(header);
+  return header->pool->buffer_size;
+}
+
+size_t PacketBuffer::GetLength() const {
+  assert(header);
+  return header->len;
+}
+
+void PacketBuffer::SetLength(size_t len) {
+  assert(header);
+  assert(len <= header->pool->buffer_size);
+  header->len = len;
+}
+
+Address& PacketBuffer::GetAddress() const {
+  assert(header);
+  return header->address;
+}
+
+bool PacketBuffer::IsUnique() const {
+  return header && header->refs.load(std::memory_order_acquire) == 1;
+}
+
+PacketPool::PacketPool(size_t buffer_size, size_t max_buffers)
+  : id(next_pool_id.fetch_add(1)), buffer_size(buffer_size),
+    stride(HEADER_SPACE + round_up(buffer_size)), max_buffers(max_buffers),
+    num_buffers(0) {
+  assert(buffer_size > 0);
+  std::lock_guard<std::mutex> guard(registry_lock);
+  live_pools().insert(id);
+}
+
+PacketPool::~PacketPool() {
+  {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    live_pools().erase(id);
+  }
+  /* other threads' caches notice on their own */
+  for(auto& entry : thread_cache.entries) {
+    if(entry.pool_id == id) {
+      entry.free.clear();
+      entry.pool_id = 0;
+    }
+  }
+}
+
+bool PacketPool::Grow() {
+  size_t count = SLAB_BUFFERS;
+  size_t have = num_buffers.load(std::memory_order_relaxed);
+  if(max_buffers) {
+    if(have >= max_buffers) return false;
+    if(count > max_buffers - have) count = max_buffers - have;
+  }
+  /* one extra cache line, so we can line the buffers up with them */
+  uint8_t* slab = new uint8_t[stride * count + CACHE_LINE];
+  slabs.emplace_back(slab);
+  uint8_t* p = reinterpret_cast<uint8_t*>
+    (round_up(reinterpret_cast<uintptr_t>(slab)));
+  for(size_t n = 0; n < count; ++n) {
+    PacketBuffer::Header* header = new(p + n * stride) PacketBuffer::Header;
+    header->pool = this;
+    header->refs.store(0, std::memory_order_relaxed);
+    header->len = 0;
+    free_list.push_back(header);
+  }
+  num_buffers.store(have + count, std::memory_order_relaxed);
+  return true;
+}
+
+void PacketPool::TakeFromShared(std::vector<PacketBuffer::Header*>& out,
+                                size_t count) {
+  std::lock_guard<std::mutex> guard(lock);
+  if(free_list.size() < count) Grow();
+  while(count-- > 0 && !free_list.empty()) {
+    out.push_back(free_list.back());
+    free_list.pop_back();
+  }
+}
+
+void PacketPool::GiveToShared(PacketBuffer::Header* const* buffers,
+                              size_t count) {
+  std::lock_guard<std::mutex> guard(lock);
+  free_list.insert(free_list.end(), buffers, buffers + count);
+}
+
+void PacketPool::Release(PacketBuffer::Header* header) {
+  auto& entry = thread_cache.Get(this);
+  entry.free.push_back(header);
+  if(entry.free.size() >= CACHE_BATCH * 2) {
+    GiveToShared(entry.free.data() + CACHE_BATCH, CACHE_BATCH);
+    entry.free.resize(CACHE_BATCH);
+  }
+}
+
+PacketBuffer PacketPool::Allocate() {
+  auto& entry = thread_cache.Get(this);
+  if(entry.free.empty()) TakeFromShared(entry.free, CACHE_BATCH);
+  if(entry.free.empty()) return PacketBuffer();
+  PacketBuffer::Header* header = entry.free.back();
+  entry.free.pop_back();
+  header->refs.store(1, std::memory_order_relaxed);
+  header->len = 0;
+  return PacketBuffer(header);
+}
+
+static IOResult out_of_buffers(ErrorCode& error_out) {
+  error_out.result = IOResult::ERROR;
+  error_out.op = ErrorCode::Op::RECEIVE;
+  error_out.err = ENOBUFS;
+  return IOResult::ERROR;
+}
+
+IOResult PacketPool::Receive(ErrorCode& error_out, SockDgram& sock,
+                             PacketBuffer& buffer_out) {
+  PacketBuffer buffer = Allocate();
+  if(!buffer) return out_of_buffers(error_out);
+  size_t len = buffer_size;
+  IOResult result = sock.Receive(error_out, buffer.GetData(), len);
+  if(result == IOResult::OKAY) {
+    buffer.header->len = len;
+    buffer_out = std::move(buffer);
+  }
+  return result;
+}
+
+IOResult PacketPool::Receive(ErrorCode& error_out, ServerSockDgram& sock,
+                             PacketBuffer& buffer_out) {
+  PacketBuffer buffer = Allocate();
+  if(!buffer) return out_of_buffers(error_out);
+  size_t len = buffer_size;
+  IOResult result = sock.Receive(error_out, buffer.GetData(), len,
+                                 buffer.header->address);
+  if(result == IOResult::OKAY) {
+    buffer.header->len = len;
+    buffer_out = std::move(buffer);
+  }
+  return result;
+}
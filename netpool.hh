@@ -0,0 +1,97 @@
+#ifndef NETPOOLHH
+#define NETPOOLHH
+
+#include "netsock.hh"
+
+#include <atomic>
+#include <mutex>
+
+namespace Net {
+  class PacketPool;
+  struct PacketThreadCache;
+  /*
+    A reference-counted handle to one of a PacketPool's buffers. Copying a
+    PacketBuffer shares the buffer (it's safe to hand copies to other
+    threads); when the last handle goes away, the buffer goes back to the
+    pool, on whichever thread that happens.
+    Set the length and address before sharing it, not after.
+  */
+  class PacketBuffer {
+    friend class PacketPool;
+    friend struct PacketThreadCache;
+    struct Header;
+    Header* header;
+    explicit inline PacketBuffer(Header* header) : header(header) {}
+  public:
+    inline PacketBuffer() : header(nullptr) {}
+    PacketBuffer(const PacketBuffer& other);
+    inline PacketBuffer(PacketBuffer&& other) : header(other.header)
+    { other.header = nullptr; }
+    PacketBuffer& operator=(const PacketBuffer& other);
+    PacketBuffer& operator=(PacketBuffer&& other);
+    inline ~PacketBuffer() { Reset(); }
+    /* lets go of the buffer; safe to call on an empty handle */
+    void Reset();
+    inline operator bool() const { return header != nullptr; }
+    uint8_t* GetData() const;
+    size_t GetCapacity() const;
+    /* how much of the buffer is in use; starts out at zero */
+    size_t GetLength() const;
+    void SetLength(size_t len);
+    /* who it came from, or is going to */
+    Address& GetAddress() const;
+    /* true if this is the only handle to its buffer */
+    bool IsUnique() const;
+  };
+  /*
+    Hands out fixed-size packet buffers without touching the allocator in
+    the common case. Each thread keeps a small cache of free buffers for
+    each pool it uses; the caches trade buffers with a shared free list in
+    batches, so the pool's lock is rarely taken. Buffers are carved out of
+    slabs that are never freed until the pool is.
+    buffer_size is usually the peer Address's GetEthernetDgramMTU() (or its
+    GetEstimatedDgramMTU(), if you never receive anything bigger), or
+    JUMBO_SIZE if you might see jumbo frames. Datagrams bigger than that
+    are truncated on receipt.
+    The pool must outlive every PacketBuffer it hands out.
+  */
+  class PacketPool {
+    friend class PacketBuffer;
+    friend struct PacketThreadCache;
+    uint64_t id;
+    size_t buffer_size, stride, max_buffers;
+    std::mutex lock;
+    std::vector<PacketBuffer::Header*> free_list;
+    std::vector<std::unique_ptr<uint8_t[]>> slabs;
+    std::atomic<size_t> num_buffers;
+    /* under lock; false if max_buffers has been reached */
+    bool Grow();
+    /* moves up to count buffers into out */
+    void TakeFromShared(std::vector<PacketBuffer::Header*>& out,
+                        size_t count);
+    void GiveToShared(PacketBuffer::Header* const* buffers, size_t count);
+    void Release(PacketBuffer::Header* header);
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+  public:
+    /* the biggest UDP payload in a 9000-byte IPv4 jumbo frame */
+    static const size_t JUMBO_SIZE = 8972;
+    /* max_buffers of 0 means no limit */
+    explicit PacketPool(size_t buffer_size, size_t max_buffers = 0);
+    ~PacketPool();
+    /* Returns an empty handle if max_buffers are already in use. */
+    PacketBuffer Allocate();
+    /* Allocate, and Receive into the buffer, setting its length (and, for
+       a ServerSockDgram, its address). buffer_out is only touched on OKAY.
+       If there are no buffers left, returns ERROR with ENOBUFS. */
+    IOResult Receive(ErrorCode& error_out, SockDgram& sock,
+                     PacketBuffer& buffer_out);
+    IOResult Receive(ErrorCode& error_out, ServerSockDgram& sock,
+                     PacketBuffer& buffer_out);
+    inline size_t GetBufferSize() const { return buffer_size; }
+    /* how many buffers have been carved out so far, in use or not */
+    inline size_t GetBufferCount() const { return num_buffers.load(); }
+  };
+}
+
+#endif
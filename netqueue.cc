@@ -0,0 +1,218 @@
+#include "netqueue.hh"
+
+using namespace Net;
+
+static size_t round_up_capacity(size_t capacity) {
+  size_t ret = 1;
+  while(ret < capacity) ret <<= 1;
+  return ret;
+}
+
+SPSCPacketQueue::SPSCPacketQueue(size_t capacity, size_t packet_size)
+  : mask(round_up_capacity(capacity) - 1), packet_size(packet_size),
+    head(0), cached_tail(0), tail(0), cached_head(0) {
+  assert(packet_size > 0);
+  storage.reset(new uint8_t[(mask + 1) * packet_size]);
+  slots.reset(new DgramSlot[mask + 1]);
+  for(size_t n = 0; n <= mask; ++n) {
+    slots[n].buf = storage.get() + n * packet_size;
+    slots[n].len = packet_size;
+  }
+}
+
+size_t SPSCPacketQueue::GetFree() {
+  size_t pos = tail.load(std::memory_order_relaxed);
+  if(pos - cached_head > mask) {
+    cached_head = head.load(std::memory_order_acquire);
+    if(pos - cached_head > mask) return 0;
+  }
+  return mask + 1 - (pos - cached_head);
+}
+
+DgramSlot* SPSCPacketQueue::BeginPush() {
+  if(GetFree() == 0) return nullptr;
+  size_t index = tail.load(std::memory_order_relaxed) & mask;
+  DgramSlot& slot = slots[index];
+  slot.buf = storage.get() + index * packet_size;
+  slot.len = packet_size;
+  return &slot;
+}
+
+void SPSCPacketQueue::EndPush() {
+  tail.store(tail.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
+}
+
+bool SPSCPacketQueue::Push(const void* data, size_t len,
+                           const Address& address) {
+  if(len > packet_size) return false;
+  DgramSlot* slot = BeginPush();
+  if(!slot) return false;
+  memcpy(slot->buf, data, len);
+  slot->len = len;
+  slot->address = address;
+  slot->result = IOResult::OKAY;
+  EndPush();
+  return true;
+}
+
+IOResult SPSCPacketQueue::Receive(ErrorCode& error_out,
+                                  ServerSockDgram& sock, size_t& count_out) {
+  count_out = 0;
+  while(true) {
+    size_t free = GetFree();
+    if(free == 0) return IOResult::OKAY;
+    size_t pos = tail.load(std::memory_order_relaxed);
+    size_t index = pos & mask;
+    /* as far as the end of the array; the rest next time around */
+    size_t count = mask + 1 - index;
+    if(count > free) count = free;
+    for(size_t n = index; n < index + count; ++n) {
+      slots[n].buf = storage.get() + n * packet_size;
+      slots[n].len = packet_size;
+    }
+    size_t want = count;
+    IOResult result = sock.ReceiveBatch(error_out, &slots[index], count);
+    if(count > 0) {
+      tail.store(pos + count, std::memory_order_release);
+      count_out += count;
+    }
+    if(result != IOResult::OKAY)
+      return count_out > 0 ? IOResult::OKAY : result;
+    /* a short batch means the socket's empty */
+    if(count < want) return IOResult::OKAY;
+  }
+}
+
+DgramSlot* SPSCPacketQueue::Front() {
+  size_t pos = head.load(std::memory_order_relaxed);
+  if(pos == cached_tail) {
+    cached_tail = tail.load(std::memory_order_acquire);
+    if(pos == cached_tail) return nullptr;
+  }
+  return &slots[pos & mask];
+}
+
+void SPSCPacketQueue::Pop() {
+  size_t pos = head.load(std::memory_order_relaxed);
+  assert(pos != tail.load(std::memory_order_relaxed));
+  head.store(pos + 1, std::memory_order_release);
+}
+
+size_t SPSCPacketQueue::GetSize() const {
+  return tail.load(std::memory_order_acquire)
+    - head.load(std::memory_order_acquire);
+}
+
+/* slot is the first member */
+struct MPSCPacketQueue::Cell {
+  DgramSlot slot;
+  /* the position this cell was claimed at */
+  size_t pos;
+  /* pos when it's free for that position, pos + 1 when it's been published
+     at pos (see Vyukov's bounded MPMC queue) */
+  std::atomic<size_t> sequence;
+  bool valid;
+};
+
+MPSCPacketQueue::MPSCPacketQueue(size_t capacity, size_t packet_size)
+  : mask(round_up_capacity(capacity) - 1), packet_size(packet_size),
+    head(0), tail(0) {
+  assert(packet_size > 0);
+  storage.reset(new uint8_t[(mask + 1) * packet_size]);
+  cells.reset(new Cell[mask + 1]);
+  for(size_t n = 0; n <= mask; ++n) {
+    cells[n].slot.buf = storage.get() + n * packet_size;
+    cells[n].slot.len = packet_size;
+    cells[n].sequence.store(n, std::memory_order_relaxed);
+  }
+}
+
+MPSCPacketQueue::~MPSCPacketQueue() {}
+
+DgramSlot* MPSCPacketQueue::BeginPush() {
+  size_t pos = tail.load(std::memory_order_relaxed);
+  while(true) {
+    Cell& cell = cells[pos & mask];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if(diff == 0) {
+      if(tail.compare_exchange_weak(pos, pos + 1,
+                                    std::memory_order_relaxed)) {
+        cell.pos = pos;
+        cell.slot.buf = storage.get() + (pos & mask) * packet_size;
+        cell.slot.len = packet_size;
+        return &cell.slot;
+      }
+      /* compare_exchange_weak updated pos */
+    }
+    /* the consumer hasn't gotten this far yet */
+    else if(diff < 0) return nullptr;
+    /* another producer beat us to it */
+    else pos = tail.load(std::memory_order_relaxed);
+  }
+}
+
+void MPSCPacketQueue::Publish(DgramSlot* slot, bool valid) {
+  Cell& cell = *reinterpret_cast<Cell*>(slot);
+  cell.valid = valid;
+  cell.sequence.store(cell.pos + 1, std::memory_order_release);
+}
+
+bool MPSCPacketQueue::Push(const void* data, size_t len,
+                           const Address& address) {
+  if(len > packet_size) return false;
+  DgramSlot* slot = BeginPush();
+  if(!slot) return false;
+  memcpy(slot->buf, data, len);
+  slot->len = len;
+  slot->address = address;
+  slot->result = IOResult::OKAY;
+  EndPush(slot);
+  return true;
+}
+
+IOResult MPSCPacketQueue::Receive(ErrorCode& error_out,
+                                  ServerSockDgram& sock, size_t& count_out) {
+  count_out = 0;
+  while(true) {
+    DgramSlot* slot = BeginPush();
+    if(!slot) return IOResult::OKAY;
+    IOResult result = sock.Receive(error_out, slot->buf, slot->len,
+                                   slot->address);
+    if(result != IOResult::OKAY) {
+      CancelPush(slot);
+      return count_out > 0 ? IOResult::OKAY : result;
+    }
+    slot->result = result;
+    EndPush(slot);
+    ++count_out;
+  }
+}
+
+DgramSlot* MPSCPacketQueue::Front() {
+  while(true) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    Cell& cell = cells[pos & mask];
+    if(cell.sequence.load(std::memory_order_acquire) != pos + 1)
+      return nullptr;
+    if(cell.valid) return &cell.slot;
+    Pop();
+  }
+}
+
+void MPSCPacketQueue::Pop() {
+  size_t pos = head.load(std::memory_order_relaxed);
+  Cell& cell = cells[pos & mask];
+  assert(cell.sequence.load(std::memory_order_relaxed) == pos + 1);
+  cell.sequence.store(pos + mask + 1, std::memory_order_release);
+  head.store(pos + 1, std::memory_order_release);
+}
+
+size_t MPSCPacketQueue::GetSize() const {
+  size_t h = head.load(std::memory_order_acquire);
+  size_t t = tail.load(std::memory_order_acquire);
+  /* includes pushes in progress, and canceled slots the consumer hasn't
+     skipped yet */
+  return t - h;
+}
@@ -0,0 +1,106 @@
+#ifndef NETQUEUEHH
+#define NETQUEUEHH
+
+#include "netsock.hh"
+
+#include <atomic>
+
+namespace Net {
+  /*
+    Bounded, lock-free queues of datagrams, for handing packets from a
+    network thread to a game (or worker) thread without locks or allocation.
+    Every slot's buffer is allocated up front; packets are written and read
+    in place, as DgramSlots (whose buf points into the queue, and whose len
+    is how much of it is used). The capacity is rounded up to a power of
+    two.
+    Pushing: BeginPush gives you a free slot (or nullptr, if the queue is
+    full), whose len is packet_size; fill it in, and EndPush to hand it over.
+    CancelPush gives it back unused. Only one push may be in progress per
+    producer thread.
+    Popping: Front gives you the oldest slot (or nullptr), which stays yours
+    until Pop. Only one thread may pop.
+  */
+  /* one producer thread, one consumer thread */
+  class SPSCPacketQueue {
+    std::unique_ptr<uint8_t[]> storage;
+    std::unique_ptr<DgramSlot[]> slots;
+    size_t mask, packet_size;
+    /* keep what each side writes on its own cache line */
+    char pad0[64];
+    std::atomic<size_t> head;
+    /* the consumer's last look at tail */
+    size_t cached_tail;
+    char pad1[64];
+    std::atomic<size_t> tail;
+    /* the producer's last look at head */
+    size_t cached_head;
+    char pad2[64];
+    /* how many slots the producer can fill, starting at tail */
+    size_t GetFree();
+    SPSCPacketQueue(const SPSCPacketQueue&) = delete;
+    SPSCPacketQueue& operator=(const SPSCPacketQueue&) = delete;
+  public:
+    /* packet_size is usually GetEstimatedDgramMTU() (or the largest datagram
+       you expect) */
+    SPSCPacketQueue(size_t capacity, size_t packet_size);
+    /* producer */
+    DgramSlot* BeginPush();
+    void EndPush();
+    inline void CancelPush() {}
+    /* copies; returns false if the queue is full or the packet too big */
+    bool Push(const void* data, size_t len, const Address& address);
+    /* Receives as many datagrams as will fit, straight into free slots, with
+       ServerSockDgram::ReceiveBatch (so, recvmmsg where available).
+       count_out is how many were queued. Returns OKAY if anything was
+       received, or the queue was already full; otherwise, whatever
+       ReceiveBatch did. */
+    IOResult Receive(ErrorCode& error_out, ServerSockDgram& sock,
+                     size_t& count_out);
+    /* consumer */
+    DgramSlot* Front();
+    void Pop();
+    /* only approximate, if the other side is busy */
+    size_t GetSize() const;
+    inline size_t GetCapacity() const { return mask + 1; }
+    inline size_t GetPacketSize() const { return packet_size; }
+  };
+  /* any number of producer threads (one socket each, say; see
+     ShardedServer), one consumer thread */
+  class MPSCPacketQueue {
+    struct Cell;
+    std::unique_ptr<uint8_t[]> storage;
+    std::unique_ptr<Cell[]> cells;
+    size_t mask, packet_size;
+    char pad0[64];
+    std::atomic<size_t> head;
+    char pad1[64];
+    std::atomic<size_t> tail;
+    char pad2[64];
+    void Publish(DgramSlot* slot, bool valid);
+    MPSCPacketQueue(const MPSCPacketQueue&) = delete;
+    MPSCPacketQueue& operator=(const MPSCPacketQueue&) = delete;
+  public:
+    MPSCPacketQueue(size_t capacity, size_t packet_size);
+    ~MPSCPacketQueue();
+    /* producers; unlike SPSCPacketQueue's, EndPush and CancelPush need to
+       be told which slot */
+    DgramSlot* BeginPush();
+    inline void EndPush(DgramSlot* slot) { Publish(slot, true); }
+    /* the consumer silently skips a canceled slot */
+    inline void CancelPush(DgramSlot* slot) { Publish(slot, false); }
+    bool Push(const void* data, size_t len, const Address& address);
+    /* Receives datagrams, one at a time, straight into free slots, until the
+       socket would block or the queue is full. Otherwise like
+       SPSCPacketQueue::Receive. */
+    IOResult Receive(ErrorCode& error_out, ServerSockDgram& sock,
+                     size_t& count_out);
+    /* consumer */
+    DgramSlot* Front();
+    void Pop();
+    size_t GetSize() const;
+    inline size_t GetCapacity() const { return mask + 1; }
+    inline size_t GetPacketSize() const { return packet_size; }
+  };
+}
+
+#endif
@@ -0,0 +1,446 @@
+#include "netrecord.hh"
+#include "nettimer.hh"
+#include "io.hh"
+
+#include <map>
+#include <thread>
+
+using namespace Net;
+
+static const char MAGIC[8] = {'T','E','G','r','e','c',0,1};
+
+#define TYPE_ATTACH 0
+#define TYPE_SEND 1
+#define TYPE_RECEIVE 2
+#define TYPE_MASK 3
+#define FLAG_ADDRESS 4
+#define FLAG_CUT 8
+
+/* how much to buffer before writing it out */
+#define RECORD_BUFFER 65536
+/* what Replayer reads (and throws away) replies into */
+#define DRAIN_BUFFER 65536
+
+struct Net::RecordChannel {
+  Recorder* recorder;
+  uint32_t id;
+  Recorder::Kind kind;
+};
+
+static void put_varint(std::vector<uint8_t>& buffer, uint64_t value) {
+  while(value >= 0x80) {
+    buffer.push_back((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  buffer.push_back(value);
+}
+
+static bool get_varint(std::istream& in, uint64_t& value_out) {
+  value_out = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    int c = in.get();
+    if(c == EOF) return false;
+    value_out |= (uint64_t)(c & 0x7F) << shift;
+    if(!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+Recorder::Recorder()
+  : snap_len(NO_SNAP_LEN), last_us(0), records(0), bytes_written(0) {}
+
+Recorder::~Recorder() {
+  Close();
+}
+
+bool Recorder::Open(std::string& error_out, const std::string& path,
+                    size_t snap_len) {
+  Close();
+  std::lock_guard<std::mutex> guard(lock);
+  out = IO::OpenRawPathForWrite(path, false);
+  if(!out) {
+    error_out = "Could not open " + path + " for writing";
+    return false;
+  }
+  this->snap_len = snap_len;
+  last_us = TimerWheel::Now();
+  records = 0;
+  buffer.assign(MAGIC, MAGIC + sizeof(MAGIC));
+  bytes_written = buffer.size();
+  /* anything that was attached before, is still attached */
+  for(auto& channel : channels) {
+    buffer.push_back(0);
+    buffer.push_back(TYPE_ATTACH);
+    put_varint(buffer, channel->id);
+    buffer.push_back((uint8_t)channel->kind);
+  }
+  return true;
+}
+
+void Recorder::Attach(Sock& sock, Kind kind) {
+  std::lock_guard<std::mutex> guard(lock);
+  RecordChannel* channel
+    = new RecordChannel{this, (uint32_t)channels.size(), kind};
+  channels.emplace_back(channel);
+  sock.record = channel;
+  if(!out) return;
+  uint64_t now = TimerWheel::Now();
+  size_t was = buffer.size();
+  put_varint(buffer, now - last_us);
+  last_us = now;
+  buffer.push_back(TYPE_ATTACH);
+  put_varint(buffer, channel->id);
+  buffer.push_back((uint8_t)kind);
+  bytes_written += buffer.size() - was;
+}
+
+void Recorder::Detach(Sock& sock) {
+  sock.record = nullptr;
+}
+
+void Recorder::WriteOut() {
+  if(!out || buffer.empty()) return;
+  out->write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+  buffer.clear();
+}
+
+void Recorder::Flush() {
+  std::lock_guard<std::mutex> guard(lock);
+  WriteOut();
+  if(out) out->flush();
+}
+
+void Recorder::Close() {
+  std::lock_guard<std::mutex> guard(lock);
+  WriteOut();
+  out.reset();
+  buffer.clear();
+}
+
+uint64_t Recorder::GetRecordCount() {
+  std::lock_guard<std::mutex> guard(lock);
+  return records;
+}
+
+uint64_t Recorder::GetBytesWritten() {
+  std::lock_guard<std::mutex> guard(lock);
+  return bytes_written;
+}
+
+void Net::RecordIO(RecordChannel* channel, bool send, const Address* address,
+                   const void* data, size_t len,
+                   const void* data2, size_t len2) {
+  Recorder& recorder = *channel->recorder;
+  std::lock_guard<std::mutex> guard(recorder.lock);
+  if(!recorder.out) return;
+  std::vector<uint8_t>& buffer = recorder.buffer;
+  size_t was = buffer.size();
+  size_t total = len + len2;
+  /* no data means SendFile, where we never see it */
+  size_t keep = !data ? 0
+    : total < recorder.snap_len ? total : recorder.snap_len;
+  uint64_t now = TimerWheel::Now();
+  put_varint(buffer, now - recorder.last_us);
+  recorder.last_us = now;
+  uint8_t type = send ? TYPE_SEND : TYPE_RECEIVE;
+  if(address && address->Valid()) type |= FLAG_ADDRESS;
+  if(keep < total) type |= FLAG_CUT;
+  buffer.push_back(type);
+  put_varint(buffer, channel->id);
+  put_varint(buffer, total);
+  if(type & FLAG_CUT) put_varint(buffer, keep);
+  if(type & FLAG_ADDRESS) {
+    Endpoint endpoint(*address);
+    bool v6 = endpoint.family == AF_INET6;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(endpoint.addr);
+    buffer.push_back(v6 ? 6 : 4);
+    buffer.insert(buffer.end(), bytes, bytes + (v6 ? 16 : 4));
+    bytes = reinterpret_cast<const uint8_t*>(&endpoint.port);
+    buffer.insert(buffer.end(), bytes, bytes + 2);
+  }
+  if(keep > 0) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    size_t first = keep < len ? keep : len;
+    buffer.insert(buffer.end(), p, p + first);
+    if(keep > first) {
+      p = reinterpret_cast<const uint8_t*>(data2);
+      buffer.insert(buffer.end(), p, p + (keep - first));
+    }
+  }
+  ++recorder.records;
+  recorder.bytes_written += buffer.size() - was;
+  if(buffer.size() >= RECORD_BUFFER) recorder.WriteOut();
+}
+
+struct Replayer::Channel {
+  Recorder::Kind kind;
+  /* the server hung up on (or refused) this stream; stop playing it */
+  bool closed;
+  SockStream stream;
+  std::vector<uint8_t> pending;
+  SockDgram dgram;
+  std::map<Endpoint, std::unique_ptr<SockDgram>> peers;
+  Channel(Recorder::Kind kind) : kind(kind), closed(false) {}
+};
+
+Replayer::Replayer()
+  : drain_buf(new uint8_t[DRAIN_BUFFER]), have_next(false), done(true),
+    play_received(true), speed(1.0), start_us(0), record_us(0) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+Replayer::~Replayer() {}
+
+bool Replayer::Open(std::string& error_out, const std::string& path) {
+  in = IO::OpenRawPathForRead(path, false);
+  channels.clear();
+  have_next = false;
+  done = true;
+  if(!in) {
+    error_out = "Could not open " + path;
+    return false;
+  }
+  char magic[sizeof(MAGIC)];
+  if(!in->read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC))) {
+    error_out = path + " is not a recording";
+    in.reset();
+    return false;
+  }
+  return true;
+}
+
+bool Replayer::ReadRecord(std::string& error_out) {
+  while(true) {
+    uint64_t delta, channel;
+    /* a clean end, as long as it's between records */
+    if(in->peek() == EOF) return true;
+    int type;
+    if(!get_varint(*in, delta) || (type = in->get()) == EOF
+       || !get_varint(*in, channel) || channel > 0xFFFFFFFF) {
+      error_out = "Truncated recording";
+      return false;
+    }
+    record_us += delta;
+    if((type & TYPE_MASK) == TYPE_ATTACH) {
+      int kind = in->get();
+      if(kind < 0 || kind > (int)Recorder::Kind::SOCK_STREAM) {
+        error_out = "Bad attach record";
+        return false;
+      }
+      if(channel >= channels.size()) channels.resize(channel + 1);
+      channels[channel].reset(new Channel((Recorder::Kind)kind));
+      continue;
+    }
+    Record& r = next;
+    r.time_us = record_us;
+    r.type = type;
+    r.channel = channel;
+    uint64_t keep;
+    if(!get_varint(*in, r.len)) {
+      error_out = "Truncated recording";
+      return false;
+    }
+    keep = r.len;
+    if((type & FLAG_CUT) && !get_varint(*in, keep)) {
+      error_out = "Truncated recording";
+      return false;
+    }
+    if(keep > r.len || r.len > 0x7FFFFFFF) {
+      error_out = "Bad record length";
+      return false;
+    }
+    r.address = Address();
+    if(type & FLAG_ADDRESS) {
+      uint8_t bytes[16 + 2];
+      int family = in->get();
+      size_t addr_len = family == 6 ? 16 : 4;
+      if((family != 4 && family != 6)
+         || !in->read(reinterpret_cast<char*>(bytes), addr_len + 2)) {
+        error_out = "Bad address in recording";
+        return false;
+      }
+      if(family == 6) {
+        memset(&r.address.in6, 0, sizeof(r.address.in6));
+        r.address.in6.sin6_family = AF_INET6;
+        memcpy(r.address.in6.sin6_addr.s6_addr, bytes, 16);
+        memcpy(&r.address.in6.sin6_port, bytes + 16, 2);
+      }
+      else {
+        memset(&r.address.in, 0, sizeof(r.address.in));
+        r.address.in.sin_family = AF_INET;
+        memcpy(&r.address.in.sin_addr.s_addr, bytes, 4);
+        memcpy(&r.address.in.sin_port, bytes + 4, 2);
+      }
+    }
+    /* padded out to the full length with zeroes */
+    r.data.assign(r.len, 0);
+    if(keep > 0 && !in->read(reinterpret_cast<char*>(r.data.data()), keep)) {
+      error_out = "Truncated recording";
+      return false;
+    }
+    have_next = true;
+    return true;
+  }
+}
+
+bool Replayer::Start(std::string& error_out, const Address& target,
+                     uint64_t now_us, double speed, bool play_received) {
+  if(!in) {
+    error_out = "No recording is open";
+    return false;
+  }
+  this->target = target;
+  this->speed = speed;
+  this->play_received = play_received;
+  start_us = now_us;
+  record_us = 0;
+  memset(&stats, 0, sizeof(stats));
+  done = false;
+  return true;
+}
+
+bool Replayer::Play(std::string& error_out) {
+  Record& r = next;
+  if(r.channel >= channels.size() || !channels[r.channel]) {
+    error_out = "Record for a channel that was never attached";
+    return false;
+  }
+  Channel& channel = *channels[r.channel];
+  ++stats.records;
+  ErrorCode error;
+  IOResult result;
+  switch(channel.kind) {
+  case Recorder::Kind::SOCK_STREAM:
+    if(channel.closed) return true;
+    if(!channel.stream) {
+      if(channel.stream.Connect(error_out, target, true) != IOResult::OKAY)
+        return false;
+      channel.stream.SetBlocking(false);
+      ++stats.sockets;
+    }
+    channel.pending.insert(channel.pending.end(), r.data.begin(),
+                           r.data.end());
+    return true;
+  case Recorder::Kind::SOCK_DGRAM:
+    if(!channel.dgram) {
+      if(channel.dgram.Connect(error_out, target) != IOResult::OKAY)
+        return false;
+      ++stats.sockets;
+    }
+    result = channel.dgram.Send(error, r.data.data(), r.data.size());
+    break;
+  case Recorder::Kind::SERVER_SOCK_DGRAM:
+  default:
+    {
+      std::unique_ptr<SockDgram>& sock = channel.peers[Endpoint(r.address)];
+      if(!sock) {
+        sock.reset(new SockDgram());
+        if(sock->Connect(error_out, target) != IOResult::OKAY) return false;
+        ++stats.sockets;
+      }
+      result = sock->Send(error, r.data.data(), r.data.size());
+    }
+    break;
+  }
+  if(result == IOResult::OKAY) {
+    ++stats.sent;
+    stats.bytes_sent += r.data.size();
+  }
+  else if(result == IOResult::WOULD_BLOCK) ++stats.dropped;
+  else ++stats.errors;
+  return true;
+}
+
+void Replayer::Drain() {
+  uint8_t* buf = drain_buf.get();
+  for(auto& p : channels) {
+    if(!p) continue;
+    Channel& channel = *p;
+    ErrorCode error;
+    size_t len;
+    if(channel.stream) {
+      IOResult result;
+      do {
+        len = DRAIN_BUFFER;
+        result = channel.stream.Receive(error, buf, len);
+      } while(result == IOResult::OKAY);
+      /* send all we can; at speed 0, this is where the time goes */
+      if(result == IOResult::WOULD_BLOCK) {
+        while(!channel.pending.empty()) {
+          len = channel.pending.size();
+          result = channel.stream.Send(error, channel.pending.data(), len);
+          if(result != IOResult::OKAY) break;
+          stats.sent += 1;
+          stats.bytes_sent += len;
+          channel.pending.erase(channel.pending.begin(),
+                                channel.pending.begin() + len);
+        }
+      }
+      if(result != IOResult::OKAY && result != IOResult::WOULD_BLOCK) {
+        ++stats.errors;
+        channel.stream.Close();
+        channel.pending.clear();
+        channel.closed = true;
+      }
+    }
+    if(channel.dgram) {
+      do len = DRAIN_BUFFER;
+      while(channel.dgram.Receive(error, buf, len) == IOResult::OKAY);
+    }
+    for(auto& peer : channel.peers) {
+      do len = DRAIN_BUFFER;
+      while(peer.second->Receive(error, buf, len) == IOResult::OKAY);
+    }
+  }
+}
+
+bool Replayer::Update(std::string& error_out, uint64_t now_us) {
+  if(done) return true;
+  while(true) {
+    if(!have_next) {
+      if(!ReadRecord(error_out)) return false;
+      if(!have_next) break;
+    }
+    if((next.type & TYPE_MASK) != (play_received ? TYPE_RECEIVE
+                                   : TYPE_SEND)) {
+      have_next = false;
+      continue;
+    }
+    uint64_t due = speed > 0 ? start_us + (uint64_t)(next.time_us / speed)
+      : now_us;
+    if(due > now_us) break;
+    if(now_us - due > stats.max_lag_us) stats.max_lag_us = now_us - due;
+    if(!Play(error_out)) return false;
+    have_next = false;
+  }
+  Drain();
+  if(!have_next) {
+    done = true;
+    for(auto& channel : channels)
+      if(channel && !channel->pending.empty()) done = false;
+  }
+  return true;
+}
+
+size_t Replayer::GetTimeout(uint64_t now_us) const {
+  if(done) return ~(size_t)0;
+  /* streams that are waiting for room */
+  if(!have_next) return 1000;
+  uint64_t due = speed > 0 ? start_us + (uint64_t)(next.time_us / speed)
+    : now_us;
+  return due > now_us ? due - now_us : 0;
+}
+
+bool Replayer::Run(std::string& error_out, const Address& target,
+                   double speed, bool play_received) {
+  if(!Start(error_out, target, TimerWheel::Now(), speed, play_received))
+    return false;
+  while(true) {
+    if(!Update(error_out, TimerWheel::Now())) return false;
+    if(done) return true;
+    size_t timeout = GetTimeout(TimerWheel::Now());
+    if(timeout > 10000) timeout = 10000;
+    if(timeout > 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(timeout));
+  }
+}
@@ -0,0 +1,146 @@
+#ifndef NETRECORDHH
+#define NETRECORDHH
+
+#include "netsock.hh"
+
+#include <mutex>
+
+namespace Net {
+  /*
+    Records everything some Socks send and receive, with timestamps, into a
+    compact binary log, for Replayer to play back later. Attach the Socks
+    you're interested in; every successful Send/Receive (and their batched,
+    segmented, coalesced, buffered and file-sending relatives) is logged.
+    The Recorder must outlive the Socks attached to it, or they must be
+    Detached first. An attachment survives Close and moves, like SetStats.
+    Thread safe; Socks on different threads may share a Recorder.
+    Disabled entirely by defining TEG_NO_NET_RECORD.
+
+    Format: the 8-byte magic "TEGrec\0\1", then records of:
+      varint: microseconds since the previous record
+      byte: type (low two bits: 0 = a channel was attached, 1 = send,
+        2 = receive; bit 2: has an address; bit 3: payload cut short)
+      varint: channel (a number per attached Sock, from 0)
+      for an attach: byte: Recorder::Kind
+      for a send/receive:
+        varint: length
+        if cut short, varint: how much of the payload follows
+        if it has an address: byte 4 or 6, then that many times 4 bytes of
+          address, then 2 bytes of port, all in network byte order
+        the payload
+  */
+  class Recorder {
+  public:
+    enum class Kind : uint8_t { SOCK_DGRAM, SERVER_SOCK_DGRAM, SOCK_STREAM };
+    static const size_t NO_SNAP_LEN = ~(size_t)0;
+  private:
+    std::unique_ptr<std::ostream> out;
+    std::vector<std::unique_ptr<RecordChannel>> channels;
+    std::vector<uint8_t> buffer;
+    size_t snap_len;
+    uint64_t last_us;
+    uint64_t records, bytes_written;
+    std::mutex lock;
+    void Attach(Sock& sock, Kind kind);
+    void WriteOut();
+    friend void RecordIO(RecordChannel*, bool, const Address*,
+                         const void*, size_t, const void*, size_t);
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+  public:
+    Recorder();
+    ~Recorder();
+    /* snap_len is how much of each payload to keep, like tcpdump's -s;
+       lengths and timing are always kept in full */
+    bool Open(std::string& error_out, const std::string& path,
+              size_t snap_len = NO_SNAP_LEN);
+    inline void Attach(SockDgram& sock) { Attach(sock, Kind::SOCK_DGRAM); }
+    inline void Attach(ServerSockDgram& sock)
+    { Attach(sock, Kind::SERVER_SOCK_DGRAM); }
+    inline void Attach(SockStream& sock) { Attach(sock, Kind::SOCK_STREAM); }
+    static void Detach(Sock& sock);
+    /* writes out whatever's buffered */
+    void Flush();
+    /* Flushes and closes the file. Attached Socks stop being recorded, but
+       stay attached (harmlessly) until Detached or the Recorder is
+       destroyed. */
+    void Close();
+    inline bool IsOpen() const { return !!out; }
+    uint64_t GetRecordCount();
+    uint64_t GetBytesWritten();
+  };
+  /*
+    Plays back a Recorder's log against a live server, through the same
+    socket classes, to load-test it with realistically-shaped traffic.
+    By default it plays what the recorded Socks received; record a server,
+    and you can replay its clients. Each recorded SockStream gets a new
+    connection to target, each recorded SockDgram gets a new SockDgram, and
+    each peer that a recorded ServerSockDgram heard from gets its own
+    SockDgram, so the server sees as many clients as it did originally.
+    Payloads that were cut short are padded with zeroes. Whatever the
+    server sends back is read and thrown away. Datagrams that would block
+    are dropped (and counted), as they would be on the network; stream data
+    that would block is queued.
+  */
+  class Replayer {
+  public:
+    struct Stats {
+      uint64_t records, sent, bytes_sent, dropped, errors;
+      /* sockets opened */
+      uint64_t sockets;
+      /* how far behind schedule we fell, at worst */
+      uint64_t max_lag_us;
+    };
+  private:
+    struct Record {
+      uint64_t time_us;
+      uint8_t type;
+      uint32_t channel;
+      uint64_t len;
+      Address address;
+      std::vector<uint8_t> data;
+    };
+    struct Channel;
+    std::unique_ptr<std::istream> in;
+    std::vector<std::unique_ptr<Channel>> channels;
+    /* where replies are read into, and thrown away */
+    std::unique_ptr<uint8_t[]> drain_buf;
+    Record next;
+    bool have_next, done, play_received;
+    Address target;
+    double speed;
+    uint64_t start_us, record_us;
+    Stats stats;
+    bool ReadRecord(std::string& error_out);
+    bool Play(std::string& error_out);
+    void Drain();
+    Replayer(const Replayer&) = delete;
+    Replayer& operator=(const Replayer&) = delete;
+  public:
+    Replayer();
+    ~Replayer();
+    bool Open(std::string& error_out, const std::string& path);
+    /* speed is a multiplier (2 = twice as fast), or 0 for as fast as
+       possible. If play_received is false, plays what the recorded Socks
+       sent instead. */
+    bool Start(std::string& error_out, const Address& target, uint64_t now_us,
+               double speed = 1.0, bool play_received = true);
+    /* Sends everything that's due by now_us. Returns false on an error
+       reading the log, or connecting a stream. */
+    bool Update(std::string& error_out, uint64_t now_us);
+    /* how long until the next record is due (0 if it already is) */
+    size_t GetTimeout(uint64_t now_us) const;
+    /* once everything's been played (and every stream's caught up) */
+    inline bool IsDone() const { return done; }
+    inline const Stats& GetStats() const { return stats; }
+    /* does the whole thing, sleeping between records */
+    bool Run(std::string& error_out, const Address& target,
+             double speed = 1.0, bool play_received = true);
+  };
+  /* for netsock.cc */
+  void RecordIO(RecordChannel* channel, bool send, const Address* address,
+                const void* data, size_t len,
+                const void* data2 = nullptr, size_t len2 = 0);
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "netresolve.hh"
+
+using namespace Net;
+
+Resolver::Resolver()
+  : ttl(0), max_cache_entries(0), woken(false), stopping(false) {}
+
+Resolver::~Resolver() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  jobs_cond.notify_all();
+  /* a worker that's stuck in getaddrinfo will hold us up until it returns;
+     nothing we can do about that */
+  for(auto& worker : workers) worker.join();
+}
+
+bool Resolver::Init(std::string& error_out, size_t num_threads,
+                    uint32_t ttl_ms, size_t max_cache_entries) {
+  assert(workers.empty());
+  if(notify_sock.MakeLoop(error_out) != IOResult::OKAY) return false;
+  if(num_threads == 0) num_threads = 1;
+  ttl = std::chrono::milliseconds(ttl_ms);
+  this->max_cache_entries = max_cache_entries;
+  for(size_t n = 0; n < num_threads; ++n)
+    workers.emplace_back(&Resolver::WorkerLoop, this);
+  return true;
+}
+
+void Resolver::WorkerLoop() {
+  std::unique_lock<std::mutex> guard(lock);
+  while(true) {
+    while(!stopping && jobs.empty()) jobs_cond.wait(guard);
+    if(stopping) return;
+    Completion completion;
+    completion.key = std::move(jobs.front());
+    jobs.pop_front();
+    guard.unlock();
+    completion.success = ResolveHost(completion.error, completion.addresses,
+                                     completion.key.host.c_str(),
+                                     completion.key.port,
+                                     completion.key.v4only);
+    guard.lock();
+    completions.emplace_back(std::move(completion));
+    /* one wake per batch of completions is enough, but it has to make it;
+       if it doesn't, the next completion (if any) won't send another, so
+       keep trying */
+    while(!woken && !stopping) {
+      ErrorCode error;
+      char c = 0;
+      if(notify_sock.Send(error, &c, 1) == IOResult::OKAY) woken = true;
+      else {
+        guard.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        guard.lock();
+        /* Dispatch may have come along and taken everything anyway */
+        if(completions.empty()) break;
+      }
+    }
+  }
+}
+
+bool Resolver::Resolve(const char* host, uint16_t port, bool v4only,
+                       Callback callback) {
+  assert(host != nullptr);
+  Key key{host, port, v4only};
+  auto now = std::chrono::steady_clock::now();
+  auto it = cache.find(key);
+  if(it != cache.end()) {
+    Entry& entry = it->second;
+    if(entry.pending) {
+      entry.waiting.emplace_back(std::move(callback));
+      return false;
+    }
+    else if(now < entry.expiry) {
+      callback(true, std::string(), entry.addresses);
+      return true;
+    }
+  }
+  else {
+    if(cache.size() >= max_cache_entries) PruneCache();
+    it = cache.emplace(key, Entry()).first;
+  }
+  Entry& entry = it->second;
+  entry.pending = true;
+  entry.addresses.clear();
+  entry.waiting.emplace_back(std::move(callback));
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    jobs.emplace_back(std::move(key));
+  }
+  jobs_cond.notify_one();
+  return false;
+}
+
+void Resolver::Dispatch() {
+  ErrorCode error;
+  char buf[16];
+  size_t len;
+  do {
+    len = sizeof(buf);
+  } while(notify_sock.Receive(error, buf, len) == IOResult::OKAY);
+  std::vector<Completion> done;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done.swap(completions);
+    woken = false;
+  }
+  auto now = std::chrono::steady_clock::now();
+  for(auto& completion : done) {
+    auto it = cache.find(completion.key);
+    /* pending entries are never removed anywhere else, but be safe */
+    if(it == cache.end()) continue;
+    std::vector<Callback> waiting;
+    waiting.swap(it->second.waiting);
+    if(completion.success) {
+      it->second.pending = false;
+      it->second.expiry = now + ttl;
+      it->second.addresses = completion.addresses;
+    }
+    /* failures aren't cached */
+    else cache.erase(it);
+    /* it may be invalid from here on; callbacks can call Resolve */
+    for(auto& callback : waiting)
+      callback(completion.success, completion.error, completion.addresses);
+  }
+}
+
+void Resolver::PruneCache() {
+  auto now = std::chrono::steady_clock::now();
+  for(auto it = cache.begin(); it != cache.end();) {
+    if(!it->second.pending && now >= it->second.expiry) it = cache.erase(it);
+    else ++it;
+  }
+  /* still full of live results; forget the ones that were looked up
+     longest ago */
+  while(cache.size() >= max_cache_entries) {
+    auto oldest = cache.end();
+    for(auto it = cache.begin(); it != cache.end(); ++it) {
+      if(!it->second.pending && (oldest == cache.end()
+                                 || it->second.expiry < oldest->second.expiry))
+        oldest = it;
+    }
+    /* lookups in progress can't be forgotten */
+    if(oldest == cache.end()) break;
+    cache.erase(oldest);
+  }
+}
+
+void Resolver::ClearCache() {
+  for(auto it = cache.begin(); it != cache.end();) {
+    if(!it->second.pending) it = cache.erase(it);
+    else ++it;
+  }
+}
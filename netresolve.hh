@@ -0,0 +1,99 @@
+#ifndef NETRESOLVEHH
+#define NETRESOLVEHH
+
+#include "netsock.hh"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace Net {
+  /*
+    An asynchronous, caching alternative to ResolveHost.
+    Lookups happen on a pool of worker threads. Successful results are cached
+    for a fixed time, keyed by (host, port, v4only), and concurrent lookups of
+    the same key share a single getaddrinfo call.
+    Completions come back through the readiness loop: register
+    GetNotifySock() for reading with your Poller (or pass it to Select), and
+    call Dispatch whenever it's readable. Callbacks are only ever called from
+    Resolve (for cache hits) or Dispatch, on the thread that called them.
+    Everything but the worker threads is single-threaded, like the rest of
+    Net.
+  */
+  class Resolver {
+  public:
+    /* on failure, addresses is empty and error is set */
+    typedef std::function<void(bool success, const std::string& error,
+                               const std::forward_list<Address>& addresses)>
+    Callback;
+  private:
+    struct Key {
+      std::string host;
+      uint16_t port;
+      bool v4only;
+      inline bool operator==(const Key& other) const {
+        return port == other.port && v4only == other.v4only
+          && host == other.host;
+      }
+    };
+    struct KeyHash {
+      inline size_t operator()(const Key& key) const {
+        return std::hash<std::string>()(key.host)
+          ^ (size_t)key.port * 0x2D535737U ^ (size_t)key.v4only;
+      }
+    };
+    struct Entry {
+      bool pending;
+      std::chrono::steady_clock::time_point expiry;
+      std::forward_list<Address> addresses;
+      std::vector<Callback> waiting;
+    };
+    struct Completion {
+      Key key;
+      bool success;
+      std::string error;
+      std::forward_list<Address> addresses;
+    };
+    std::unordered_map<Key, Entry, KeyHash> cache;
+    std::chrono::milliseconds ttl;
+    size_t max_cache_entries;
+    SockDgram notify_sock;
+    std::vector<std::thread> workers;
+    /* everything below here is protected by lock */
+    std::mutex lock;
+    std::condition_variable jobs_cond;
+    std::deque<Key> jobs;
+    std::vector<Completion> completions;
+    /* a wake has been sent since the last Dispatch took completions */
+    bool woken;
+    bool stopping;
+    void WorkerLoop();
+    void PruneCache();
+    Resolver(const Resolver&) = delete;
+    Resolver(Resolver&&) = delete;
+  public:
+    Resolver();
+    ~Resolver();
+    /* Starts the worker threads. Cached results are kept for ttl_ms. When
+       the cache reaches max_cache_entries, expired entries are pruned, and
+       if that isn't enough, the oldest results are forgotten to make
+       room. */
+    bool Init(std::string& error_out, size_t num_threads = 2,
+              uint32_t ttl_ms = 60000, size_t max_cache_entries = 256);
+    /* Returns true if the result was already cached, in which case callback
+       has already been called. Otherwise, callback will be called from a
+       later Dispatch. */
+    bool Resolve(const char* host, uint16_t port, bool v4only,
+                 Callback callback);
+    /* Call when GetNotifySock() is readable. */
+    void Dispatch();
+    /* Forget every cached result. Lookups in progress are unaffected. */
+    void ClearCache();
+    inline Sock& GetNotifySock() { return notify_sock; }
+  };
+}
+
+#endif
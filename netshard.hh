@@ -0,0 +1,133 @@
+#ifndef NETSHARDHH
+#define NETSHARDHH
+
+#include "netsock.hh"
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace Net {
+  /*
+    Serves one port from several threads at once. Each shard has its own
+    socket, bound to the same port with SO_REUSEPORT, its own Poller and its
+    own thread; the kernel spreads incoming datagrams (or connections) across
+    the sockets.
+    S is ServerSockDgram or ServerSockStream. With one shard, SO_REUSEPORT
+    isn't used, and this is just an ordinary Bind plus a thread.
+    The handler is called, on the shard's own thread, for every event the
+    shard's Poller reports. The shard's socket is registered for reading to
+    begin with; the handler may register other socks (accepted connections,
+    say) with shard.poller, and should handle their events too.
+    The handler is called concurrently from every shard's thread, so it must
+    not touch shared state without synchronization.
+  */
+  template<class S> class ShardedServer {
+  public:
+    struct Shard {
+      size_t index;
+      S sock;
+      Poller poller;
+    private:
+      friend class ShardedServer;
+      SockDgram wake_sock;
+      std::thread thread;
+    };
+    typedef std::function<void(Shard& shard, const Poller::Event& event)>
+    Handler;
+  private:
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<bool> stopping;
+    Handler handler;
+    int backlog;
+    static bool BindOne(std::string& error_out, ServerSockDgram& sock,
+                        const char* bind_address, uint16_t port, IPVersion v,
+                        int, bool reuse_port) {
+      return sock.Bind(error_out, bind_address, port, v, reuse_port);
+    }
+    static bool BindOne(std::string& error_out, ServerSockStream& sock,
+                        const char* bind_address, uint16_t port, IPVersion v,
+                        int backlog, bool reuse_port) {
+      return sock.Bind(error_out, bind_address, port, v, backlog, reuse_port);
+    }
+    void ShardLoop(Shard& shard) {
+      while(true) {
+        for(auto& event : shard.poller.Wait()) {
+          if(event.sock == &shard.wake_sock) {
+            if(stopping.load()) return;
+            ErrorCode error;
+            char buf[16];
+            size_t len;
+            do {
+              len = sizeof(buf);
+            } while(shard.wake_sock.Receive(error, buf, len) == IOResult::OKAY);
+          }
+          else handler(shard, event);
+        }
+      }
+    }
+    ShardedServer(const ShardedServer&) = delete;
+    ShardedServer(ShardedServer&&) = delete;
+  public:
+    /* backlog is only used for ServerSockStream */
+    ShardedServer(int backlog = 5) : stopping(false), backlog(backlog) {}
+    ~ShardedServer() { Stop(); }
+    /* Bind num_shards sockets. If port is 0, they all share whichever port
+       the first one gets. */
+    bool Bind(std::string& error_out, size_t num_shards,
+              const char* bind_address, uint16_t port, IPVersion v) {
+      assert(shards.empty());
+      if(num_shards == 0) num_shards = 1;
+      bool reuse_port = num_shards > 1;
+      for(size_t n = 0; n < num_shards; ++n) {
+        std::unique_ptr<Shard> shard(new Shard);
+        shard->index = n;
+        if(!BindOne(error_out, shard->sock, bind_address, port, v, backlog,
+                    reuse_port)
+           || shard->wake_sock.MakeLoop(error_out) != IOResult::OKAY
+           || !shard->poller.Register(error_out, shard->sock, true, false)
+           || !shard->poller.Register(error_out, shard->wake_sock,
+                                      true, false)) {
+          shards.clear();
+          return false;
+        }
+        if(port == 0) {
+          Address address;
+          if(!shard->sock.GetSockName(address)) {
+            error_out = "Unable to determine the bound port";
+            shards.clear();
+            return false;
+          }
+          port = ntohs(Endpoint(address).port);
+        }
+        shards.emplace_back(std::move(shard));
+      }
+      return true;
+    }
+    /* Start every shard's thread. Only call once, after Bind. */
+    void Start(Handler handler) {
+      this->handler = std::move(handler);
+      for(auto& shard : shards)
+        shard->thread = std::thread(&ShardedServer::ShardLoop, this,
+                                    std::ref(*shard));
+    }
+    /* Stop and join every shard's thread. The sockets stay bound. */
+    void Stop() {
+      stopping.store(true);
+      for(auto& shard : shards) {
+        if(!shard->thread.joinable()) continue;
+        ErrorCode error;
+        char c = 0;
+        shard->wake_sock.Send(error, &c, 1);
+      }
+      for(auto& shard : shards) {
+        if(shard->thread.joinable()) shard->thread.join();
+      }
+      stopping.store(false);
+    }
+    inline size_t GetShardCount() const { return shards.size(); }
+    inline Shard& GetShard(size_t index) { return *shards[index]; }
+  };
+}
+
+#endif
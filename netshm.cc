@@ -0,0 +1,518 @@
+#include "netshm.hh"
+#include "netinternal.hh"
+
+#include <atomic>
+#include <errno.h>
+
+#if __linux__ && !defined(TEG_NO_SHM_STREAM)
+# define HAVE_SHM_STREAM 1
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+#endif
+
+using namespace Net;
+
+#if HAVE_SHM_STREAM
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "ShmStream needs lock-free atomics to share them between"
+              " processes");
+
+/* "TEGshm", and a version number */
+#define SHM_MAGIC 0x54454773686D0001ULL
+/* memory, the caller's wake, the server's wake */
+#define SHM_FDS 3
+/* how long Accept gives a client to send its handshake */
+#define HANDSHAKE_TIMEOUT_NS 1000000000ULL
+
+/*
+  One direction. head is only written by the reader, tail only by the
+  writer. The *_waiting flags work like LocalLink's: whoever is about to
+  wait sets its flag and then rechecks; whoever makes progress clears the
+  flag and pokes. The fences make sure one of them notices.
+*/
+namespace {
+  struct ShmRing {
+    std::atomic<uint64_t> head;
+    char pad0[56];
+    std::atomic<uint64_t> tail;
+    char pad1[56];
+    std::atomic<uint32_t> reader_waiting, writer_waiting;
+    std::atomic<uint32_t> reader_closed, writer_closed;
+    char pad2[48];
+  };
+}
+
+/* followed by the two rings' data; ring 0 is client to server */
+struct Net::ShmHeader {
+  uint64_t magic;
+  uint64_t ring_size;
+  char pad[48];
+  ShmRing rings[2];
+};
+
+static bool make_address(std::string& error_out, const char* name,
+                         struct sockaddr_un& addr, socklen_t& len_out) {
+  static const char prefix[] = "teg-shm:";
+  size_t name_len = strlen(name);
+  /* the leading NUL puts it in the abstract namespace */
+  if(1 + sizeof(prefix) - 1 + name_len > sizeof(addr.sun_path)) {
+    error_out = "ShmStream name is too long";
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path + 1, prefix, sizeof(prefix) - 1);
+  memcpy(addr.sun_path + sizeof(prefix), name, name_len);
+  len_out = offsetof(struct sockaddr_un, sun_path) + sizeof(prefix)
+    + name_len;
+  return true;
+}
+#endif
+
+ShmStream::ShmStream()
+  : header(nullptr), map_size(0), ring_size(0), conn(-1), peer_wake(-1),
+    side(0) {}
+
+ShmStream::ShmStream(ShmStream&& other)
+  : Sock(std::move(other)), header(other.header), map_size(other.map_size),
+    ring_size(other.ring_size), conn(other.conn), peer_wake(other.peer_wake),
+    side(other.side) {
+  other.header = nullptr;
+  other.conn = other.peer_wake = -1;
+}
+
+ShmStream& ShmStream::operator=(ShmStream&& other) {
+  if(&other == this) return *this;
+  Close();
+  Sock::operator=(std::move(other));
+  header = other.header;
+  map_size = other.map_size;
+  ring_size = other.ring_size;
+  conn = other.conn;
+  peer_wake = other.peer_wake;
+  side = other.side;
+  other.header = nullptr;
+  other.conn = other.peer_wake = -1;
+  return *this;
+}
+
+void ShmStream::Close() {
+#if HAVE_SHM_STREAM
+  if(header) {
+    header->rings[side].writer_closed.store(1, std::memory_order_release);
+    header->rings[side ^ 1].reader_closed.store(1,
+                                                std::memory_order_release);
+    poke_eventfd(peer_wake);
+    munmap(header, map_size);
+    header = nullptr;
+  }
+  if(conn >= 0) close(conn);
+  if(peer_wake >= 0) close(peer_wake);
+  conn = peer_wake = -1;
+#endif
+  Sock::Close();
+}
+
+bool ShmStream::PeerGone() {
+#if HAVE_SHM_STREAM
+  char c;
+  ssize_t result = recv(conn, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return result == 0
+    || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+        && errno != EINTR);
+#else
+  return true;
+#endif
+}
+
+uint8_t* ShmStream::GetData(int ring) {
+#if HAVE_SHM_STREAM
+  return reinterpret_cast<uint8_t*>(header + 1) + ring * ring_size;
+#else
+  (void)ring;
+  return nullptr;
+#endif
+}
+
+bool ShmStream::Connect(std::string& error_out, const char* name,
+                        size_t ring_size) {
+  Close();
+#if HAVE_SHM_STREAM
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  if(!make_address(error_out, name, addr, addr_len)) return false;
+  size_t size = 4096;
+  while(size < ring_size) size <<= 1;
+  ring_size = size;
+  int fds[SHM_FDS] = {-1, -1, -1};
+  fds[0] = memfd_create("teg-shm", MFD_CLOEXEC);
+  fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  map_size = sizeof(ShmHeader) + ring_size * 2;
+  const char* what = nullptr;
+  if(fds[0] < 0) what = "memfd_create";
+  else if(fds[1] < 0 || fds[2] < 0) what = "eventfd";
+  else if(conn < 0) what = "socket";
+  else if(ftruncate(fds[0], map_size)) what = "ftruncate";
+  else {
+    void* p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fds[0], 0);
+    if(p == MAP_FAILED) what = "mmap";
+    else {
+      /* fresh from ftruncate, so everything else is already zero */
+      header = reinterpret_cast<ShmHeader*>(p);
+      header->magic = SHM_MAGIC;
+      header->ring_size = ring_size;
+      header->rings[0].reader_waiting.store(1);
+      header->rings[1].reader_waiting.store(1);
+    }
+  }
+  if(!what) {
+  intr_retry:
+    if(connect(conn, reinterpret_cast<struct sockaddr*>(&addr), addr_len)) {
+      if(errno == EINTR) goto intr_retry;
+      what = "connect";
+    }
+  }
+  if(!what) {
+    uint64_t magic = SHM_MAGIC;
+    struct iovec iov = {&magic, sizeof(magic)};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t result;
+    do result = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    while(result < 0 && errno == EINTR);
+    if(result != sizeof(magic)) what = "sendmsg";
+  }
+  if(what) {
+    error_out = std::string("Could not connect ShmStream: ") + what + ": "
+      + strerror(errno);
+    for(int n = 0; n < SHM_FDS; ++n) if(fds[n] >= 0) close(fds[n]);
+    if(header) munmap(header, map_size);
+    header = nullptr;
+    if(conn >= 0) close(conn);
+    conn = -1;
+    return false;
+  }
+  /* the mapping keeps the memory around */
+  close(fds[0]);
+  int flags = fcntl(conn, F_GETFL);
+  fcntl(conn, F_SETFL, flags | O_NONBLOCK);
+  peer_wake = fds[2];
+  this->ring_size = ring_size;
+  side = 0;
+  Become(fds[1]);
+  return true;
+#else
+  (void)name; (void)ring_size;
+  error_out = "ShmStream isn't supported on this platform";
+  return false;
+#endif
+}
+
+IOResult ShmStream::Receive(std::string& error_out,
+                            void* buf, size_t& len_inout) {
+  ErrorCode error;
+  return describe(error_out, Receive(error, buf, len_inout), error);
+}
+
+IOResult ShmStream::Receive(ErrorCode& error_out,
+                            void* buf, size_t& len_inout) {
+  if(!header)
+    return fail(error_out, IOResult::ERROR, ErrorCode::Op::RECEIVE,
+                ErrorCode::NOT_VALID);
+#if HAVE_SHM_STREAM
+  IOProbe probe(stats, PROBE_RECEIVE);
+  ShmRing& ring = header->rings[side ^ 1];
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  uint64_t tail = ring.tail.load(std::memory_order_acquire);
+  if(tail == head) {
+    uint64_t count;
+    if(read(sock, &count, sizeof(count))) {}
+    ring.reader_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool closed = ring.writer_closed.load(std::memory_order_acquire);
+    tail = ring.tail.load(std::memory_order_acquire);
+    if(tail == head) {
+      if(closed)
+        return probe.Done(fail(error_out, IOResult::CONNECTION_CLOSED,
+                               ErrorCode::Op::RECEIVE, ErrorCode::CLOSED));
+      if(PeerGone())
+        return probe.Done(fail(error_out, IOResult::CONNECTION_CLOSED,
+                               ErrorCode::Op::RECEIVE, ECONNRESET));
+      return probe.Done(IOResult::WOULD_BLOCK);
+    }
+  }
+  uint64_t available = tail - head;
+  /* only a broken (or hostile) peer could do this */
+  if(available > ring_size)
+    return probe.Done(fail(error_out, IOResult::ERROR, ErrorCode::Op::RECEIVE,
+                           EPROTO));
+  size_t len = available < len_inout ? available : len_inout;
+  const uint8_t* data = GetData(side ^ 1);
+  size_t offset = head & (ring_size - 1);
+  size_t first = ring_size - offset < len ? ring_size - offset : len;
+  memcpy(buf, data + offset, first);
+  memcpy(reinterpret_cast<uint8_t*>(buf) + first, data, len - first);
+  ring.head.store(head + len, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(ring.writer_waiting.load(std::memory_order_relaxed)
+     && ring.writer_waiting.exchange(0))
+    poke_eventfd(peer_wake);
+  len_inout = len;
+  return probe.Done(IOResult::OKAY, len);
+#else
+  (void)buf; (void)len_inout;
+  return IOResult::ERROR;
+#endif
+}
+
+IOResult ShmStream::Send(std::string& error_out,
+                         const void* buf, size_t& len_inout) {
+  ErrorCode error;
+  return describe(error_out, Send(error, buf, len_inout), error);
+}
+
+IOResult ShmStream::Send(ErrorCode& error_out,
+                         const void* buf, size_t& len_inout) {
+  if(!header)
+    return fail(error_out, IOResult::ERROR, ErrorCode::Op::SEND,
+                ErrorCode::NOT_VALID);
+#if HAVE_SHM_STREAM
+  IOProbe probe(stats, PROBE_SEND);
+  ShmRing& ring = header->rings[side];
+  if(ring.reader_closed.load(std::memory_order_acquire))
+    return probe.Done(fail(error_out, IOResult::CONNECTION_CLOSED,
+                           ErrorCode::Op::SEND, EPIPE));
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  uint64_t head = ring.head.load(std::memory_order_acquire);
+  if(tail - head > ring_size)
+    return probe.Done(fail(error_out, IOResult::ERROR, ErrorCode::Op::SEND,
+                           EPROTO));
+  if(tail - head == ring_size) {
+    ring.writer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    head = ring.head.load(std::memory_order_acquire);
+    if(tail - head == ring_size) {
+      if(PeerGone())
+        return probe.Done(fail(error_out, IOResult::CONNECTION_CLOSED,
+                               ErrorCode::Op::SEND, EPIPE));
+      return probe.Done(IOResult::WOULD_BLOCK);
+    }
+  }
+  uint64_t space = ring_size - (tail - head);
+  size_t len = space < len_inout ? space : len_inout;
+  uint8_t* data = GetData(side);
+  size_t offset = tail & (ring_size - 1);
+  size_t first = ring_size - offset < len ? ring_size - offset : len;
+  memcpy(data + offset, buf, first);
+  memcpy(data, reinterpret_cast<const uint8_t*>(buf) + first, len - first);
+  ring.tail.store(tail + len, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(ring.reader_waiting.load(std::memory_order_relaxed)
+     && ring.reader_waiting.exchange(0))
+    poke_eventfd(peer_wake);
+  len_inout = len;
+  return probe.Done(IOResult::OKAY, len);
+#else
+  (void)buf; (void)len_inout;
+  return IOResult::ERROR;
+#endif
+}
+
+ServerShmStream::ServerShmStream(ServerShmStream&& other)
+  : Sock(std::move(other)), listener(other.listener),
+    pending(std::move(other.pending)) {
+  other.listener = -1;
+  other.pending.clear();
+}
+
+void ServerShmStream::Close() {
+#if HAVE_SHM_STREAM
+  for(auto& p : pending) close(p.conn);
+  pending.clear();
+  if(listener >= 0) close(listener);
+  listener = -1;
+#endif
+  Sock::Close();
+}
+
+bool ServerShmStream::Bind(std::string& error_out, const char* name,
+                           int backlog) {
+  Close();
+#if HAVE_SHM_STREAM
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  if(!make_address(error_out, name, addr, addr_len)) return false;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    error_out = std::string("Could not create socket: ") + strerror(errno);
+    return false;
+  }
+  if(bind(fd, reinterpret_cast<struct sockaddr*>(&addr), addr_len)) {
+    if(errno == EADDRINUSE) error_out = ADDRESS_IN_USE;
+    else error_out = std::string("Could not bind: ") + strerror(errno);
+    close(fd);
+    return false;
+  }
+  if(listen(fd, backlog)) {
+    error_out = std::string("Could not listen: ") + strerror(errno);
+    close(fd);
+    return false;
+  }
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if(epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event)) {
+    error_out = std::string("Could not create epoll: ") + strerror(errno);
+    if(epfd >= 0) close(epfd);
+    close(fd);
+    return false;
+  }
+  listener = fd;
+  Become(epfd);
+  return true;
+#else
+  (void)name; (void)backlog;
+  error_out = "ShmStream isn't supported on this platform";
+  return false;
+#endif
+}
+
+bool ServerShmStream::Accept(std::string& error_out, ShmStream& sock_out) {
+#if HAVE_SHM_STREAM
+  if(!Valid()) return false;
+  uint64_t now_ns = LatencyHistogram::Now();
+  /* everyone who's connected joins the queue to be handshaken */
+  while(true) {
+    int conn;
+    do conn = accept4(listener, nullptr, nullptr,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+    while(conn < 0 && errno == EINTR);
+    if(conn < 0) break;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = conn;
+    if(epoll_ctl(sock, EPOLL_CTL_ADD, conn, &event)) {
+      error_out = std::string("Could not accept ShmStream: epoll_ctl: ")
+        + strerror(errno);
+      close(conn);
+      return false;
+    }
+    pending.push_back({conn, now_ns + HANDSHAKE_TIMEOUT_NS});
+  }
+  for(size_t n = 0; n < pending.size(); ++n) {
+    int conn = pending[n].conn;
+    IOResult result = Handshake(error_out, conn, sock_out);
+    if(result == IOResult::WOULD_BLOCK) {
+      if(now_ns < pending[n].deadline_ns) continue;
+      error_out = "Could not accept ShmStream: timed out waiting for"
+        " handshake";
+      result = IOResult::ERROR;
+    }
+    epoll_ctl(sock, EPOLL_CTL_DEL, conn, nullptr);
+    pending.erase(pending.begin() + n);
+    if(result == IOResult::OKAY) return true;
+    close(conn);
+    return false;
+  }
+  return false;
+#else
+  (void)sock_out;
+  error_out = "ShmStream isn't supported on this platform";
+  return false;
+#endif
+}
+
+/* WOULD_BLOCK if the handshake hasn't arrived yet. On success, sock_out
+   owns conn; otherwise the caller still does. */
+IOResult ServerShmStream::Handshake(std::string& error_out, int conn,
+                                    ShmStream& sock_out) {
+#if HAVE_SHM_STREAM
+  int fds[SHM_FDS];
+  int num_fds = 0;
+  uint64_t magic = 0;
+  const char* what = nullptr;
+  struct iovec iov = {&magic, sizeof(magic)};
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t result;
+  do result = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  while(result < 0 && errno == EINTR);
+  if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return IOResult::WOULD_BLOCK;
+  for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+      cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if(num_fds > SHM_FDS) num_fds = SHM_FDS;
+      memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    }
+  }
+  if(result != sizeof(magic) || magic != SHM_MAGIC || num_fds != SHM_FDS
+     || (msg.msg_flags & MSG_CTRUNC))
+    what = "bad handshake";
+  ShmHeader* header = nullptr;
+  size_t map_size = 0;
+  if(!what) {
+    struct stat st;
+    if(fstat(fds[0], &st) || (size_t)st.st_size < sizeof(ShmHeader))
+      what = "bad shared memory";
+    else {
+      map_size = st.st_size;
+      void* p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fds[0], 0);
+      if(p == MAP_FAILED) what = "mmap failed";
+      else {
+        header = reinterpret_cast<ShmHeader*>(p);
+        uint64_t ring_size = header->ring_size;
+        if(header->magic != SHM_MAGIC || ring_size == 0
+           || (ring_size & (ring_size - 1))
+           || ring_size > (map_size - sizeof(ShmHeader)) / 2) {
+          what = "bad shared memory";
+          munmap(header, map_size);
+        }
+      }
+    }
+  }
+  if(num_fds > 0) close(fds[0]);
+  if(what) {
+    error_out = std::string("Could not accept ShmStream: ") + what;
+    for(int n = 1; n < num_fds; ++n) close(fds[n]);
+    return IOResult::ERROR;
+  }
+  sock_out.Close();
+  sock_out.header = header;
+  sock_out.map_size = map_size;
+  sock_out.ring_size = header->ring_size;
+  sock_out.conn = conn;
+  sock_out.peer_wake = fds[1];
+  sock_out.side = 1;
+  sock_out.Become(fds[2]);
+  return IOResult::OKAY;
+#else
+  (void)error_out; (void)conn; (void)sock_out;
+  return IOResult::ERROR;
+#endif
+}
@@ -0,0 +1,100 @@
+#ifndef NETSHMHH
+#define NETSHMHH
+
+#include "netsock.hh"
+
+namespace Net {
+  struct ShmHeader;
+  /*
+    A byte stream between two processes on the same host, like a loopback
+    SockStream, except that the bytes go through a pair of rings in shared
+    memory and never touch TCP. Same Send/Receive/IOResult contract as
+    SockStream (partial Sends, CONNECTION_CLOSED at the end).
+    The Sock itself is an eventfd, so it plugs into a Poller (not Select).
+    It's poked when data arrives while this end was waiting for some, AND
+    when space frees up after a Send would have blocked, so: when it's
+    readable, Receive until WOULD_BLOCK, then retry any Sends that were
+    blocked. It's only poked when the other side has run dry (or full), so
+    a busy stream costs no system calls.
+    Rendezvous is through a Unix socket (in the abstract namespace, so
+    there's no file to clean up); the connecting side creates the shared
+    memory and the eventfds, and passes them over with SCM_RIGHTS. The
+    Unix socket stays open, so that if the other process dies without
+    Closing, you get CONNECTION_CLOSED the next time you find nothing to
+    Receive or no room to Send.
+    Linux only (for now); elsewhere, Connect and Bind fail.
+  */
+  class ShmStream : public Sock {
+    friend class ServerShmStream;
+    ShmHeader* header;
+    size_t map_size;
+    /* our own copy, so the other side can't change it under us */
+    size_t ring_size;
+    /* the Unix socket we met on, and the other end's eventfd */
+    int conn, peer_wake;
+    /* which ring we send on; we receive on the other */
+    int side;
+    bool PeerGone();
+    uint8_t* GetData(int ring);
+    ShmStream(const ShmStream&) = delete;
+    ShmStream& operator=(const ShmStream&) = delete;
+  public:
+    static const size_t DEFAULT_RING_SIZE = 1 << 20;
+    ShmStream();
+    inline ~ShmStream() { Close(); }
+    ShmStream(ShmStream&& other);
+    ShmStream& operator=(ShmStream&& other);
+    /* Connects to the ServerShmStream with this name, which must already be
+       listening. ring_size is per direction, and is rounded up to a power
+       of two. Blocks only as long as it takes to connect the Unix
+       socket. */
+    bool Connect(std::string& error_out, const char* name,
+                 size_t ring_size = DEFAULT_RING_SIZE);
+    IOResult Receive(std::string& error_out,
+                     void* buf, size_t& len_inout);
+    IOResult Receive(ErrorCode& error_out,
+                     void* buf, size_t& len_inout);
+    IOResult Send(std::string& error_out,
+                  const void* buf, size_t& len_inout);
+    IOResult Send(ErrorCode& error_out,
+                  const void* buf, size_t& len_inout);
+    /* the other end gets CONNECTION_CLOSED once it's Received everything
+       we Sent */
+    void Close();
+  };
+  /*
+    Readable whenever Accept has something to do. The Sock itself is an
+    epoll fd over the listening socket and every connection that hasn't
+    sent its handshake yet, so a slow client never holds up Accept; its
+    handshake is picked up by a later call, once it arrives.
+  */
+  class ServerShmStream : public Sock {
+    struct Pending {
+      int conn;
+      uint64_t deadline_ns;
+    };
+    /* the Unix socket we listen on */
+    int listener;
+    std::vector<Pending> pending;
+    IOResult Handshake(std::string& error_out, int conn,
+                       ShmStream& sock_out);
+    ServerShmStream(const ServerShmStream&) = delete;
+    ServerShmStream& operator=(const ServerShmStream&) = delete;
+  public:
+    inline ServerShmStream() : listener(-1) {}
+    ServerShmStream(ServerShmStream&& other);
+    inline ~ServerShmStream() { Close(); }
+    /* name is anything up to 100 or so bytes that both processes agree on
+       (e.g. the game's name and the server's port) */
+    bool Bind(std::string& error_out, const char* name, int backlog = 5);
+    /* Returns false if nobody's ready, in which case error_out is left
+       empty; or on an error, such as a bad handshake, which only affects
+       that one connection. Never waits. A client that hasn't sent its
+       handshake within a second of connecting is dropped (with an error)
+       by the next Accept after that. */
+    bool Accept(std::string& error_out, ShmStream& sock_out);
+    void Close();
+  };
+}
+
+#endif
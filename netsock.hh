@@ -2,7 +2,11 @@
 #define NETSOCKHH
 
 #include "teg.hh"
+#include "netstats.hh"
 #include <forward_list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <string.h>
 
 #if __WIN32__
@@ -16,15 +20,23 @@
 #include <unistd.h>
 #endif
 
+#if __linux__ && !defined(TEG_NO_EPOLL)
+#define NETSOCK_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
 /*
   Some socket classes. Yay!
   Sockets are always non-blocking.
   Socket member functions that return "bool" return true for success and false
   for failure. Some have an error_out parameter into which they deposit an
-  error message on failure.
+  error message on failure. (Send/Receive can also take an ErrorCode, which is
+  cheaper.)
   Bool-returning socket setup functions (i.e. everything but Send/Receive) also
   implicitly Close the socket on failure, rendering it an uninitialized socket
   once more. Socks are never left "half-initialized".
+  Socks can be waited on either with Select, which takes a fresh set of lists
+  every call, or with a Poller, which remembers registrations between calls.
   Sock::Hash returns a well-distributed hash value that is constant as long as
   the Sock remains valid. Closing / reinitializing a Sock changes its Hash. The
   onus is on you to ensure that everything you use this hash value for forgets
@@ -37,6 +49,10 @@ namespace Net {
 #define INVALID_SOCKET -1
 #endif
   enum class IPVersion : int { V4 = PF_INET, V6 = PF_INET6 };
+  union Address;
+  struct RecordChannel;
+  bool ResolveHost(std::string& error_out, std::forward_list<Address>& ret,
+                   const char* host, uint16_t port, bool v4only);
   union Address {
   private:
     struct sockaddr faceless;
@@ -50,6 +66,11 @@ namespace Net {
     friend class ServerSockStream;
     friend class ServerSockDgram;
     friend class Select;
+    friend class CompletionQueue;
+    friend class Connector;
+    friend class Recorder;
+    friend class Replayer;
+    friend struct Endpoint;
     friend bool Net::ResolveHost(std::string&, std::forward_list<Address>&,
                                  const char*, uint16_t, bool);
     size_t Length() const;
@@ -64,6 +85,14 @@ namespace Net {
        IPv6: ::1
        IPv6: ::ffff:127.0.0.0/8 */
     bool IsLoopback() const;
+    /* in host byte order; 0 if the Address isn't valid */
+    inline uint16_t GetPort() const {
+      switch(faceless.sa_family) {
+      case AF_INET6: return ntohs(in6.sin6_port);
+      case AF_INET: return ntohs(in.sin_port);
+      default: return 0;
+      }
+    }
     std::string ToString() const;
     std::string ToLongString() const;
     inline size_t Hash() const {
@@ -90,9 +119,98 @@ namespace Net {
       default: return 0;
       }
     }
+    /* what fits in a standard Ethernet frame; NOT guaranteed to be safe, see
+       PathMTU */
+    inline int GetEthernetDgramMTU() const {
+      switch(faceless.sa_family) {
+      case AF_INET6: return 1452; // 1500 - 48
+      case AF_INET: return 1472; // 1500 - 28
+      default: return 0;
+      }
+    }
     inline operator bool() const { return Valid(); }
     inline bool Valid() const { return faceless.sa_family == AF_INET6 || faceless.sa_family == AF_INET; }
   };
+  /* A compact (20-byte) copy of an IPv4/IPv6 Address's host and port, for
+     per-client and per-packet structures where a whole Address would be
+     wasteful. Comparing and hashing are a handful of integer operations.
+     Hash gives the same value as Address::Hash; ordering is consistent, but
+     not the same as Address's.
+     Endpoints made from invalid Addresses are all equal to one another, and
+     turn back into invalid Addresses. */
+  struct Endpoint {
+    /* both in network byte order; an IPv4 address only uses addr[0] */
+    uint32_t addr[4];
+    uint16_t port;
+    uint16_t family; // AF_INET, AF_INET6, or AF_UNSPEC
+    inline Endpoint() : addr{0,0,0,0}, port(0), family(AF_UNSPEC) {}
+    inline Endpoint(const Address& address) {
+      switch(address.faceless.sa_family) {
+      case AF_INET6:
+        memcpy(addr, address.in6.sin6_addr.s6_addr, sizeof(addr));
+        port = address.in6.sin6_port;
+        family = AF_INET6;
+        break;
+      case AF_INET:
+        addr[0] = address.in.sin_addr.s_addr;
+        addr[1] = addr[2] = addr[3] = 0;
+        port = address.in.sin_port;
+        family = AF_INET;
+        break;
+      default:
+        addr[0] = addr[1] = addr[2] = addr[3] = 0;
+        port = 0;
+        family = AF_UNSPEC;
+      }
+    }
+    inline Address ToAddress() const {
+      Address ret;
+      switch(family) {
+      case AF_INET6:
+        memset(&ret.in6, 0, sizeof(ret.in6));
+        ret.in6.sin6_family = AF_INET6;
+        memcpy(ret.in6.sin6_addr.s6_addr, addr, sizeof(addr));
+        ret.in6.sin6_port = port;
+        break;
+      case AF_INET:
+        memset(&ret.in, 0, sizeof(ret.in));
+        ret.in.sin_family = AF_INET;
+        ret.in.sin_addr.s_addr = addr[0];
+        ret.in.sin_port = port;
+        break;
+      }
+      return ret;
+    }
+    inline bool operator==(const Endpoint& other) const {
+      return ((addr[0] ^ other.addr[0]) | (addr[1] ^ other.addr[1])
+              | (addr[2] ^ other.addr[2]) | (addr[3] ^ other.addr[3])
+              | (uint32_t)(port ^ other.port)
+              | (uint32_t)(family ^ other.family)) == 0;
+    }
+    inline bool operator!=(const Endpoint& other) const
+    { return !(*this == other); }
+    inline bool operator<(const Endpoint& other) const {
+      if(family != other.family) return family < other.family;
+      for(int n = 0; n < 4; ++n)
+        if(addr[n] != other.addr[n]) return addr[n] < other.addr[n];
+      return port < other.port;
+    }
+    inline size_t Hash() const {
+      if(family == AF_INET6)
+        return (size_t)addr[0] * 0x36CCC1D3U ^
+          (size_t)addr[1] * 0xABD43619U ^
+          (size_t)addr[2] * 0x482A7F83U ^
+          (size_t)addr[3] * 0xBF8A54BBU ^
+          (size_t)port * 0x6D20E3F1U;
+      else
+        return (size_t)addr[0] * 0x506C1BBBU ^
+          (size_t)port * 0x2D535737U;
+    }
+    inline operator bool() const { return Valid(); }
+    inline bool Valid() const
+    { return family == AF_INET6 || family == AF_INET; }
+  };
+  static_assert(sizeof(Endpoint) == 20, "Endpoint should be 20 bytes");
   enum class IOResult {
     /*
       WOULD_BLOCK: IO would block. When returned from Connect(), you should
@@ -110,11 +228,39 @@ namespace Net {
     */
     WOULD_BLOCK, OKAY, CONNECTION_CLOSED, ERROR, MSGSIZE
   };
+  /* Send/Receive have overloads that take one of these instead of a
+     std::string. They never allocate; the message isn't built until you call
+     ToString, which gives the same text the std::string overloads would have.
+     Only written on failure (including MSGSIZE, but not WOULD_BLOCK). */
+  struct ErrorCode {
+    enum class Op : uint8_t { NONE, SEND, RECEIVE };
+    /* values of err that aren't OS error codes */
+    enum : int {
+      NOT_VALID = -1, // the socket was not valid
+      CLOSED = -2, // the connection was closed in an orderly fashion
+      TRUNCATED = -3, // the OS sent only part of a datagram
+      CANCELED = -4, // see CompletionQueue::Cancel
+      FILE_ENDED = -5, // SendFile ran out of file
+    };
+    IOResult result;
+    Op op;
+    /* errno (or WSAGetLastError()) value, or one of the above */
+    int err;
+    inline ErrorCode() : result(IOResult::OKAY), op(Op::NONE), err(0) {}
+    /* if address is given, it's included in the message */
+    std::string ToString(const Address* address = nullptr) const;
+  };
   class Sock {
   protected:
     friend class ServerSockStream;
     friend class Select;
+    friend class Poller;
+    friend class CompletionQueue;
+    friend class Recorder;
     SOCKET sock;
+    SockStats* stats;
+    /* see Recorder (netrecord.hh) */
+    RecordChannel* record;
     Sock();
     ~Sock();
     Sock& operator=(const Sock&) = delete;
@@ -130,15 +276,24 @@ namespace Net {
     inline Sock(Sock&& other) {
       if(&other == this) return;
       sock = other.sock;
+      stats = other.stats;
+      record = other.record;
       other.sock = INVALID_SOCKET;
     }
     inline Sock& operator=(Sock&& other) {
       if(&other == this) return *this;
       Close();
       sock = other.sock;
+      stats = other.stats;
+      record = other.record;
       other.sock = INVALID_SOCKET;
       return *this;
     }
+    /* Counts this socket's IO in stats, as well as in the global NetStats
+       (null to stop). The SockStats must outlive the Sock, or be detached
+       first. Survives Close and moves. */
+    inline void SetStats(SockStats* stats) { this->stats = stats; }
+    inline SockStats* GetStats() const { return stats; }
     inline operator bool() const { return Valid(); }
     inline bool Valid() const { return sock != INVALID_SOCKET; }
     inline bool operator==(const Sock& other) const { return &other == this; }
@@ -153,6 +308,18 @@ namespace Net {
     }
     /* returns false on invalid/unconnected sockets, true on success */
     bool GetPeerName(Address& out);
+    /* returns false on invalid/unbound sockets, true on success */
+    bool GetSockName(Address& out);
+    /* Sets (or clears) the Don't Fragment bit on outgoing datagrams, so that
+       oversized ones fail with MSGSIZE or get dropped along the way instead
+       of being fragmented. Needed for PathMTU. On Linux, this also makes the
+       kernel ignore its own path MTU cache for this socket. */
+    bool SetDontFragment(std::string& error_out, bool dont_fragment);
+    /* Asks the kernel to pace this socket's output at no more than
+       bytes_per_second, spreading bursts out on the wire (SO_MAX_PACING_RATE,
+       Linux only; for datagrams, only with the fq qdisc). 0 means unlimited.
+       See also Pacer (netpace.hh). */
+    bool SetMaxPacingRate(std::string& error_out, uint64_t bytes_per_second);
     /* non-blocking IO is default
        blocking status is a property of the underlying OS socket and not of the
        Sock instance */
@@ -165,8 +332,26 @@ namespace Net {
                      bool initially_blocking = false);
     IOResult Receive(std::string& error_out,
                      void* buf, size_t& len_inout);
+    IOResult Receive(ErrorCode& error_out,
+                     void* buf, size_t& len_inout);
     IOResult Send(std::string& error_out,
                   const void* buf, size_t& len_inout);
+    IOResult Send(ErrorCode& error_out,
+                  const void* buf, size_t& len_inout);
+    /* Sends len_inout bytes of the file open on fd, starting at
+       offset_inout, without going through userspace; on Linux, this uses
+       sendfile. (Elsewhere, or where the file can't be used with sendfile,
+       it reads into a small buffer and Sends from that.) Doesn't depend on
+       the file position.
+       offset_inout and len_inout are updated to reflect whatever was sent,
+       even if the send is cut short. Returns OKAY once len_inout reaches
+       zero, WOULD_BLOCK if the socket fills up first (call it again when
+       it's writable), and FILE_ENDED if the file is shorter than
+       expected. See FileSender (netfile.hh) for a friendlier interface. */
+    IOResult SendFile(std::string& error_out, int fd,
+                      uint64_t& offset_inout, uint64_t& len_inout);
+    IOResult SendFile(ErrorCode& error_out, int fd,
+                      uint64_t& offset_inout, uint64_t& len_inout);
     /* Close one end of the socket. */
     void ShutdownSend();
     void ShutdownReceive();
@@ -175,6 +360,108 @@ namespace Net {
        fixed. */
     void ShutdownBoth();
   };
+  /* A SockStream with a fixed-capacity ring buffer in each direction, so
+     that callers don't have to keep track of partial sends themselves.
+     Write queues data; Flush sends as much queued data as the OS will take
+     with a single writev. Fill receives as much as will fit with a single
+     readv; Read/Peek/Consume take it back out.
+     The rings never grow. They aren't emptied when the socket is closed or
+     reconnected; call Reset for that. */
+  class BufferedSockStream : public SockStream {
+    struct Ring {
+      std::unique_ptr<uint8_t[]> buf;
+      size_t capacity, head, size;
+      Ring(size_t capacity);
+      /* returns the number of (nonempty) segments, 0-2 */
+      int GetFilled(void*(&ptrs)[2], size_t(&lens)[2]) const;
+      int GetEmpty(void*(&ptrs)[2], size_t(&lens)[2]) const;
+      void Push(const void* src, size_t len);
+      size_t Copy(void* dst, size_t len) const;
+      void Drop(size_t len);
+    } send_ring, receive_ring;
+  public:
+    BufferedSockStream(size_t send_capacity = 65536,
+                       size_t receive_capacity = 65536);
+    /* all or nothing; returns false, queueing nothing, if there isn't room
+       for all len bytes */
+    bool Write(const void* buf, size_t len);
+    /* returns OKAY if the send ring is now empty, WOULD_BLOCK if data remains
+       queued (wait for writability and try again) */
+    IOResult Flush(std::string& error_out);
+    IOResult Flush(ErrorCode& error_out);
+    /* returns OKAY if anything was received (or if the receive ring was
+       already full), otherwise whatever Receive would have */
+    IOResult Fill(std::string& error_out);
+    IOResult Fill(ErrorCode& error_out);
+    /* Read = Peek + Consume; both return the number of bytes copied */
+    size_t Read(void* buf, size_t len);
+    size_t Peek(void* buf, size_t len) const;
+    void Consume(size_t len);
+    /* discard everything in both rings */
+    void Reset();
+    inline size_t GetQueuedSize() const { return send_ring.size; }
+    inline size_t GetSendSpace() const
+    { return send_ring.capacity - send_ring.size; }
+    inline size_t GetReceivedSize() const { return receive_ring.size; }
+    inline size_t GetReceiveSpace() const
+    { return receive_ring.capacity - receive_ring.size; }
+  };
+  /* A SockStream that can send without copying into the kernel, using
+     MSG_ZEROCOPY (Linux 4.14 and up). The kernel sends straight out of your
+     buffer, which means the buffer has to stay put, unchanged, until it's
+     done; that can be long after SendZeroCopy returns.
+     Every SendZeroCopy that sends anything gets an ID, counting up from
+     zero. The kernel reports completions on the socket's error queue, which
+     makes the socket readable (as far as Poller and Select are concerned);
+     call ReapCompletions then, and IsComplete tells you when a buffer may be
+     reused. Ordinary Sends may be mixed in freely.
+     Only worth it for large sends (tens of kilobytes or more); pinning pages
+     costs more than copying small ones. Over loopback, the kernel copies
+     anyway, and says so; see GetCopiedCount.
+     Call EnableZeroCopy on every new connection. Without it (or where it's
+     unsupported), SendZeroCopy copies like Send, and its IDs complete
+     immediately (as do those of sends the kernel wouldn't pin pages for).
+     */
+  class ZeroCopySockStream : public SockStream {
+    /* every ID before this one has completed */
+    uint32_t completed;
+    uint32_t next_id;
+    /* completions that arrived before some earlier ID's */
+    std::vector<std::pair<uint32_t, uint32_t>> early;
+    /* The kernel only counts sends that really were MSG_ZEROCOPY, so after
+       a copied one, its IDs fall behind ours. Each run is the kernel's ID
+       and ours at the start of a stretch where they move together. */
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    uint32_t kernel_next;
+    uint64_t copied;
+    bool enabled;
+    void Complete(uint32_t lo, uint32_t hi);
+    void CompleteKernel(uint32_t lo, uint32_t hi);
+  public:
+    ZeroCopySockStream();
+    /* Sets SO_ZEROCOPY, and forgets about the previous connection's IDs.
+       Returns false if the kernel doesn't support it. */
+    bool EnableZeroCopy(std::string& error_out);
+    inline bool IsZeroCopyEnabled() const { return enabled; }
+    /* Like Send, but buf must not be touched until IsComplete(id_out). If
+       nothing was sent (anything but OKAY), no ID is used up. */
+    IOResult SendZeroCopy(std::string& error_out,
+                          const void* buf, size_t& len_inout,
+                          uint32_t& id_out);
+    IOResult SendZeroCopy(ErrorCode& error_out,
+                          const void* buf, size_t& len_inout,
+                          uint32_t& id_out);
+    /* Reads every completion waiting on the error queue. Returns how many
+       sends they covered. */
+    size_t ReapCompletions();
+    inline bool IsComplete(uint32_t id) const
+    { return (int32_t)(id - completed) < 0; }
+    /* how many sends haven't completed */
+    inline uint32_t GetPendingCount() const { return next_id - completed; }
+    /* how many completed sends the kernel ended up copying after all; if
+       this is most of them, zero-copy isn't doing you any good */
+    inline uint64_t GetCopiedCount() const { return copied; }
+  };
   class SockDgram : public Sock {
   public:
     /* a socket that talks to someone else */
@@ -184,30 +471,122 @@ namespace Net {
     IOResult MakeLoop(std::string& error_out);
     IOResult Receive(std::string& error_out,
                      void* buf, size_t& len_inout);
+    IOResult Receive(ErrorCode& error_out,
+                     void* buf, size_t& len_inout);
     IOResult Send(std::string& error_out,
                   const void* buf, size_t len);
+    IOResult Send(ErrorCode& error_out,
+                  const void* buf, size_t len);
   };
   class ServerSock : public Sock {
   protected:
     bool SubBind(std::string& error_out, const char* bind_address,
-                 uint16_t port, IPVersion v, int type);
+                 uint16_t port, IPVersion v, int type, bool reuse_port);
   };
   class ServerSockStream : public ServerSock {
   public:
+    /* reuse_port sets SO_REUSEPORT, allowing several sockets to bind the
+       same port and share its traffic; see ShardedServer (netshard.hh) */
     bool Bind(std::string& error_out, const char* bind_address,
-              uint16_t port, IPVersion v, int backlog = 5);
+              uint16_t port, IPVersion v, int backlog = 5,
+              bool reuse_port = false);
     bool Accept(SockStream& sock_out, Address& address_out);
+    /* Accepts up to max_count pending connections, into the first entries of
+       socks_out and addresses_out; returns how many. On Linux, this uses
+       accept4, so each connection costs exactly one system call. Stops when
+       nothing's left, or on an error (like running out of file
+       descriptors), which is written to err_out if given; connections that
+       were aborted or failed before we got to them are skipped, and counted
+       in aborted_out if given.
+       If it stops because we're out of file descriptors (EMFILE/ENFILE),
+       the connection is still waiting, so the listener stays readable; stop
+       polling it for a while, or use Acceptor (netaccept.hh), which sheds
+       such connections instead. */
+    size_t AcceptBatch(SockStream* socks_out, Address* addresses_out,
+                       size_t max_count, int* err_out = nullptr,
+                       size_t* aborted_out = nullptr);
+  };
+  /* One datagram's worth of ServerSockDgram::ReceiveBatch/SendBatch.
+     SendBatch doesn't write to buf. */
+  struct DgramSlot {
+    void* buf;
+    size_t len;
+    Address address;
+    IOResult result;
   };
   class ServerSockDgram : public ServerSock {
+    /* SendBatch, but if stop_at_failure, stops after the first slot that
+       fails, and returns its result */
+    IOResult SendBatch(ErrorCode& error_out, DgramSlot* slots,
+                       size_t& count_inout, bool stop_at_failure);
   public:
+    /* see ServerSockStream::Bind for reuse_port */
     bool Bind(std::string& error_out, const char* bind_address,
-              uint16_t port, IPVersion v);
+              uint16_t port, IPVersion v, bool reuse_port = false);
     IOResult Receive(std::string& error_out,
                      void* buf, size_t& len_inout,
                      Address& address_out);
+    IOResult Receive(ErrorCode& error_out,
+                     void* buf, size_t& len_inout,
+                     Address& address_out);
     IOResult Send(std::string& error_out,
                   const void* buf, size_t len,
                   const Address& address);
+    IOResult Send(ErrorCode& error_out,
+                  const void* buf, size_t len,
+                  const Address& address);
+    /* Batched versions of the above, which use recvmmsg/sendmmsg where
+       available and fall back to a loop elsewhere.
+       ReceiveBatch: on entry, count_inout is the number of slots, whose
+       buf/len describe buffers to fill. On return, count_inout is the number
+       of slots filled; each of those has its len, address and result (OKAY)
+       set. Returns OKAY if anything was received, and otherwise whatever
+       Receive would have.
+       SendBatch: on entry, count_inout is the number of slots to send. On
+       return, count_inout is the number of slots that were attempted; each
+       of those has the result that Send would have given it. Only stops
+       early if a send would block, in which case it returns WOULD_BLOCK;
+       otherwise it returns OKAY, even if some slots failed. error_out
+       describes the last slot to fail. */
+    IOResult ReceiveBatch(std::string& error_out,
+                          DgramSlot* slots, size_t& count_inout);
+    IOResult ReceiveBatch(ErrorCode& error_out,
+                          DgramSlot* slots, size_t& count_inout);
+    IOResult SendBatch(std::string& error_out,
+                       DgramSlot* slots, size_t& count_inout);
+    IOResult SendBatch(ErrorCode& error_out,
+                       DgramSlot* slots, size_t& count_inout);
+    /* Sends len bytes to one address as a run of datagrams, segment_size
+       bytes each (the last may be shorter). On Linux, uses UDP segmentation
+       offload, so the whole run costs one system call per 64 datagrams or
+       64K; elsewhere, or if the kernel or route can't do it, falls back to
+       SendBatch. Stops at the first segment that would block or fails;
+       sent_out is the number of bytes (whole segments) that went out before
+       it. Results as for Send. */
+    IOResult SendSegmented(std::string& error_out,
+                           const void* buf, size_t len, size_t segment_size,
+                           const Address& address, size_t& sent_out);
+    IOResult SendSegmented(ErrorCode& error_out,
+                           const void* buf, size_t len, size_t segment_size,
+                           const Address& address, size_t& sent_out);
+    /* Asks the kernel to coalesce runs of same-sized datagrams from the same
+       sender (UDP GRO, Linux only). Once it's on, receive with
+       ReceiveCoalesced and a buffer of at least 65535 bytes; Receive and
+       ReceiveBatch would get the runs without knowing where the datagrams
+       within them begin. */
+    bool SetReceiveCoalescing(std::string& error_out, bool coalesce);
+    /* Like Receive, but may receive a run of datagrams from address_out at
+       once: len_inout bytes, split into segment_size_out-byte datagrams (the
+       last may be shorter). segment_size_out == len_inout if it's just the
+       one. */
+    IOResult ReceiveCoalesced(std::string& error_out,
+                              void* buf, size_t& len_inout,
+                              size_t& segment_size_out,
+                              Address& address_out);
+    IOResult ReceiveCoalesced(ErrorCode& error_out,
+                              void* buf, size_t& len_inout,
+                              size_t& segment_size_out,
+                              Address& address_out);
   };
   class Select {
     std::forward_list<ServerSockStream*> readable_ss;
@@ -243,6 +622,179 @@ namespace Net {
     inline const std::forward_list<SockDgram*>&
     GetWritableSockDgrams() { return writable_d; }
   };
+  /* Like Select, but persistent. Register a Sock once and it stays registered
+     until you Unregister it; each Wait then costs time proportional to the
+     number of ready socks rather than the number of registered ones.
+     Uses epoll where available (and has no FD_SETSIZE limit there), and falls
+     back to select() everywhere else.
+     You MUST Unregister a Sock before closing, moving, or destroying it.
+     userdata is not interpreted; it's handed back to you in each Event. */
+  class Poller {
+  public:
+    struct Event {
+      Sock* sock;
+      void* userdata;
+      bool readable, writable;
+    };
+  private:
+    struct Registration {
+      Sock* sock;
+      void* userdata;
+      bool want_read, want_write;
+    };
+    std::unordered_map<SOCKET, Registration> registrations;
+    std::vector<Event> events;
+#if NETSOCK_HAVE_EPOLL
+    int epfd;
+    std::vector<struct epoll_event> epoll_events;
+    bool EpollControl(std::string& error_out, int op, Registration& reg);
+#endif
+    Poller(const Poller&) = delete;
+    Poller(Poller&&) = delete;
+  public:
+    Poller();
+    ~Poller();
+    /* returns false if the Sock is invalid, already registered, or (in
+       select() mode) too large for an fd_set */
+    bool Register(std::string& error_out, Sock& sock,
+                  bool want_read, bool want_write, void* userdata = nullptr);
+    /* Changes the interest set of an already-registered Sock. A Sock that
+       wants neither is never reported, not even when it hangs up. */
+    bool Modify(std::string& error_out, Sock& sock,
+                bool want_read, bool want_write);
+    /* safe to call on a Sock that isn't registered */
+    void Unregister(Sock& sock);
+    /* The returned list is only valid until the next call to Wait. Each Sock
+       appears in it at most once. */
+    const std::vector<Event>& Wait(size_t max_timeout_us = ~(size_t)0);
+    inline size_t GetCount() const { return registrations.size(); }
+    /* true if we're using epoll, false if we're using select() */
+    inline bool IsPersistent() const {
+#if NETSOCK_HAVE_EPOLL
+      return epfd >= 0;
+#else
+      return false;
+#endif
+    }
+  };
+  /*
+    A flat hash table mapping Endpoints (or Addresses) to T, for looking up a
+    peer's state on every incoming datagram. Keys are stored inline as
+    Endpoints, with linear probing and backward-shift deletion, so there's no
+    allocation except when the table grows.
+    T must be default-constructible and movable.
+    Pointers returned by Find/Insert are invalidated by any Insert or Erase.
+    Don't Insert or Erase from inside ForEach.
+  */
+  template<class T> class PeerTable {
+    struct Slot {
+      Endpoint key;
+      bool occupied;
+      T value;
+    };
+    std::unique_ptr<Slot[]> slots;
+    size_t mask, count;
+    /* Endpoint::Hash leaves the low bits poorly mixed */
+    inline size_t HomeOf(const Endpoint& key) const {
+      size_t hash = key.Hash();
+      return (hash ^ (hash >> 15) ^ (hash >> 27)) & mask;
+    }
+    /* returns the slot holding key, or the empty slot where it belongs */
+    inline size_t Probe(const Endpoint& key) const {
+      size_t i = HomeOf(key);
+      while(slots[i].occupied && slots[i].key != key) i = (i + 1) & mask;
+      return i;
+    }
+    void Grow() {
+      std::unique_ptr<Slot[]> old_slots(std::move(slots));
+      size_t old_size = mask + 1;
+      mask = mask * 2 + 1;
+      slots.reset(new Slot[mask + 1]());
+      for(size_t n = 0; n < old_size; ++n) {
+        if(!old_slots[n].occupied) continue;
+        Slot& slot = slots[Probe(old_slots[n].key)];
+        slot.key = old_slots[n].key;
+        slot.occupied = true;
+        slot.value = std::move(old_slots[n].value);
+      }
+    }
+  public:
+    /* initial_capacity is rounded up to a power of two */
+    PeerTable(size_t initial_capacity = 16) : count(0) {
+      size_t size = 4;
+      while(size < initial_capacity) size *= 2;
+      mask = size - 1;
+      slots.reset(new Slot[size]());
+    }
+    inline size_t GetCount() const { return count; }
+    T* Find(const Endpoint& key) {
+      Slot& slot = slots[Probe(key)];
+      return slot.occupied ? &slot.value : nullptr;
+    }
+    const T* Find(const Endpoint& key) const {
+      const Slot& slot = slots[Probe(key)];
+      return slot.occupied ? &slot.value : nullptr;
+    }
+    /* returns the existing value, or a newly default-constructed one;
+       inserted_out (if given) says which */
+    T& Insert(const Endpoint& key, bool* inserted_out = nullptr) {
+      size_t i = Probe(key);
+      if(slots[i].occupied) {
+        if(inserted_out) *inserted_out = false;
+        return slots[i].value;
+      }
+      /* keep the load factor at or below 3/4 */
+      if((count + 1) * 4 > (mask + 1) * 3) {
+        Grow();
+        i = Probe(key);
+      }
+      slots[i].key = key;
+      slots[i].occupied = true;
+      slots[i].value = T();
+      ++count;
+      if(inserted_out) *inserted_out = true;
+      return slots[i].value;
+    }
+    inline T& operator[](const Endpoint& key) { return Insert(key); }
+    /* returns false if there was no such entry */
+    bool Erase(const Endpoint& key) {
+      size_t i = Probe(key);
+      if(!slots[i].occupied) return false;
+      /* backward-shift: pull later members of the cluster into the hole, as
+         long as that doesn't move them before their home slot */
+      size_t j = i;
+      while(true) {
+        j = (j + 1) & mask;
+        if(!slots[j].occupied) break;
+        size_t home = HomeOf(slots[j].key);
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+          slots[i].key = slots[j].key;
+          slots[i].value = std::move(slots[j].value);
+          i = j;
+        }
+      }
+      slots[i].occupied = false;
+      slots[i].value = T();
+      --count;
+      return true;
+    }
+    void Clear() {
+      for(size_t n = 0; n <= mask; ++n) {
+        if(slots[n].occupied) {
+          slots[n].occupied = false;
+          slots[n].value = T();
+        }
+      }
+      count = 0;
+    }
+    /* func(const Endpoint&, T&) is called for every entry, in no particular
+       order */
+    template<class F> void ForEach(F func) {
+      for(size_t n = 0; n <= mask; ++n) {
+        if(slots[n].occupied) func(slots[n].key, slots[n].value);
+      }
+    }
+  };
   /* ret is *not* implicitly cleared!
      this blocks; if you want asynchronous resolution, use a thread */
   bool ResolveHost(std::string& error_out, std::forward_list<Address>& ret,
@@ -253,6 +805,9 @@ namespace std {
   template<> struct hash<Net::Address> {
     size_t operator()(const Net::Address& wat) const { return wat.Hash(); }
   };
+  template<> struct hash<Net::Endpoint> {
+    size_t operator()(const Net::Endpoint& wat) const { return wat.Hash(); }
+  };
   /* Warning: Socks are mutable! */
   template<> struct hash<Net::Sock> {
     size_t operator()(const Net::Sock& wat) const { return wat.Hash(); }
@@ -0,0 +1,221 @@
+#include "netstats.hh"
+#include "netsock.hh"
+
+#include <chrono>
+#include <mutex>
+
+using namespace Net;
+
+#define FOR_EACH_COUNTER(X) \
+  X(bytes_sent) X(bytes_received) X(packets_sent) X(packets_received) \
+  X(send_would_block) X(receive_would_block) X(interrupted) X(msgsize) \
+  X(send_errors) X(receive_errors) X(waits) X(wakeups) X(wait_us)
+
+#define NUM_KINDS 3
+
+std::atomic<bool> LatencyHistogram::enabled(false);
+
+namespace {
+  /* only ever written by its own thread */
+  struct ThreadStats {
+    NetCounters<std::atomic<uint64_t>> counters;
+    std::atomic<uint64_t> histograms[NUM_KINDS][LatencyHistogram::BUCKETS];
+    ThreadStats();
+    ~ThreadStats();
+  };
+  struct Registry {
+    std::mutex lock;
+    std::vector<ThreadStats*> threads;
+    /* what threads that have exited left behind */
+    NetStats retired;
+    LatencyHistogram retired_histograms[NUM_KINDS];
+    Registry() : retired(), retired_histograms() {}
+  };
+}
+
+static Registry& registry() {
+  static Registry ret;
+  return ret;
+}
+
+static thread_local ThreadStats thread_stats;
+
+/* single writer, so there's no need for an atomic add */
+static inline void bump(std::atomic<uint64_t>& counter, uint64_t amount) {
+  counter.store(counter.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+}
+
+static int bucket_for(uint64_t ns) {
+  if(ns == 0) return 0;
+  int ret = 64 - __builtin_clzll(ns);
+  return ret < LatencyHistogram::BUCKETS ? ret : LatencyHistogram::BUCKETS-1;
+}
+
+ThreadStats::ThreadStats() {
+#define X(name) counters.name.store(0, std::memory_order_relaxed);
+  FOR_EACH_COUNTER(X)
+#undef X
+  for(auto& histogram : histograms)
+    for(auto& bucket : histogram) bucket.store(0, std::memory_order_relaxed);
+  Registry& r = registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+  r.threads.push_back(this);
+}
+
+ThreadStats::~ThreadStats() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+#define X(name) r.retired.name += counters.name.load(std::memory_order_relaxed);
+  FOR_EACH_COUNTER(X)
+#undef X
+  for(int kind = 0; kind < NUM_KINDS; ++kind)
+    for(int n = 0; n < LatencyHistogram::BUCKETS; ++n)
+      r.retired_histograms[kind].buckets[n]
+        += histograms[kind][n].load(std::memory_order_relaxed);
+  for(auto it = r.threads.begin(); it != r.threads.end(); ++it) {
+    if(*it == this) {
+      r.threads.erase(it);
+      break;
+    }
+  }
+}
+
+NetStats NetStats::GetGlobal() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+  NetStats ret = r.retired;
+  for(auto thread : r.threads) {
+#define X(name) ret.name += thread->counters.name.load(std::memory_order_relaxed);
+    FOR_EACH_COUNTER(X)
+#undef X
+  }
+  return ret;
+}
+
+NetStats NetStats::operator-(const NetStats& other) const {
+  NetStats ret;
+#define X(name) ret.name = name - other.name;
+  FOR_EACH_COUNTER(X)
+#undef X
+  return ret;
+}
+
+SockStats::SockStats() {
+  Reset();
+}
+
+NetStats SockStats::Get() const {
+  NetStats ret;
+#define X(name) ret.name = name.load(std::memory_order_relaxed);
+  FOR_EACH_COUNTER(X)
+#undef X
+  return ret;
+}
+
+void SockStats::Reset() {
+#define X(name) name.store(0, std::memory_order_relaxed);
+  FOR_EACH_COUNTER(X)
+#undef X
+}
+
+uint64_t LatencyHistogram::GetCount() const {
+  uint64_t ret = 0;
+  for(auto bucket : buckets) ret += bucket;
+  return ret;
+}
+
+uint64_t LatencyHistogram::GetPercentile(double fraction) const {
+  uint64_t count = GetCount();
+  if(count == 0) return 0;
+  uint64_t want = (uint64_t)(fraction * count + 0.5);
+  if(want < 1) want = 1;
+  uint64_t seen = 0;
+  for(int n = 0; n < BUCKETS; ++n) {
+    seen += buckets[n];
+    if(seen >= want) return n == 0 ? 0 : (1ULL << n) - 1;
+  }
+  return (1ULL << (BUCKETS - 1)) - 1;
+}
+
+LatencyHistogram LatencyHistogram::GetGlobal(LatencyKind kind) {
+  int index = (int)kind;
+  Registry& r = registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+  LatencyHistogram ret = r.retired_histograms[index];
+  for(auto thread : r.threads)
+    for(int n = 0; n < BUCKETS; ++n)
+      ret.buckets[n]
+        += thread->histograms[index][n].load(std::memory_order_relaxed);
+  return ret;
+}
+
+void LatencyHistogram::SetEnabled(bool enabled) {
+  LatencyHistogram::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Net::CountIO(SockStats* stats, bool send, IOResult result,
+                  uint64_t bytes, uint64_t packets, uint64_t start_ns) {
+  auto& counters = thread_stats.counters;
+  std::atomic<uint64_t>* global;
+  std::atomic<uint64_t>* local;
+  uint64_t amount = 1;
+  switch(result) {
+  case IOResult::OKAY:
+    if(send) bump(counters.bytes_sent, bytes);
+    else bump(counters.bytes_received, bytes);
+    if(stats) {
+      if(send) stats->bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+      else stats->bytes_received.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    amount = packets;
+    global = send ? &counters.packets_sent : &counters.packets_received;
+    local = !stats ? nullptr
+      : send ? &stats->packets_sent : &stats->packets_received;
+    break;
+  case IOResult::WOULD_BLOCK:
+    global = send ? &counters.send_would_block
+      : &counters.receive_would_block;
+    local = !stats ? nullptr
+      : send ? &stats->send_would_block : &stats->receive_would_block;
+    break;
+  case IOResult::MSGSIZE:
+    global = &counters.msgsize;
+    local = stats ? &stats->msgsize : nullptr;
+    break;
+  default:
+    global = send ? &counters.send_errors : &counters.receive_errors;
+    local = !stats ? nullptr
+      : send ? &stats->send_errors : &stats->receive_errors;
+    break;
+  }
+  bump(*global, amount);
+  if(local) local->fetch_add(amount, std::memory_order_relaxed);
+  if(start_ns) {
+    uint64_t now = LatencyHistogram::Now();
+    bump(thread_stats.histograms[send ? (int)LatencyKind::SEND
+                                 : (int)LatencyKind::RECEIVE]
+         [bucket_for(now - start_ns)], 1);
+  }
+}
+
+void Net::CountInterrupted(SockStats* stats) {
+  bump(thread_stats.counters.interrupted, 1);
+  if(stats) stats->interrupted.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Net::CountWait(uint64_t start_ns, bool woke) {
+  uint64_t elapsed = LatencyHistogram::Now() - start_ns;
+  auto& counters = thread_stats.counters;
+  bump(counters.waits, 1);
+  if(woke) bump(counters.wakeups, 1);
+  bump(counters.wait_us, elapsed / 1000);
+  if(LatencyHistogram::IsEnabled())
+    bump(thread_stats.histograms[(int)LatencyKind::WAIT]
+         [bucket_for(elapsed)], 1);
+}
@@ -0,0 +1,84 @@
+#ifndef NETSTATSHH
+#define NETSTATSHH
+
+#include "teg.hh"
+
+#include <atomic>
+
+namespace Net {
+  enum class IOResult;
+  /*
+    What netsock.cc has been up to. Counters only ever go up; to get a rate,
+    take two snapshots and subtract.
+    Every thread keeps its own counters (and nobody else writes to them), so
+    counting costs about as much as an ordinary increment; GetGlobal adds
+    them all up. A socket can also be given its own SockStats (which any
+    number of sockets may share); see Sock::SetStats.
+    Compile with TEG_NO_NET_STATS to leave out all the counting.
+  */
+  template<class T> struct NetCounters {
+    /* bytes of payload */
+    T bytes_sent, bytes_received;
+    /* datagrams, or (for streams) successful Sends and Receives */
+    T packets_sent, packets_received;
+    T send_would_block, receive_would_block;
+    /* system calls repeated because of EINTR */
+    T interrupted;
+    /* sends that came back MSGSIZE */
+    T msgsize;
+    /* ERROR and CONNECTION_CLOSED results */
+    T send_errors, receive_errors;
+    /* Select and Poller waits, how many of them had something ready, and
+       how long they took, all together */
+    T waits, wakeups, wait_us;
+  };
+  struct NetStats : public NetCounters<uint64_t> {
+    /* everything since startup, from every thread (even ones that have
+       exited) */
+    static NetStats GetGlobal();
+    NetStats operator-(const NetStats& other) const;
+  };
+  class SockStats : public NetCounters<std::atomic<uint64_t>> {
+    SockStats(const SockStats&) = delete;
+    SockStats& operator=(const SockStats&) = delete;
+  public:
+    SockStats();
+    NetStats Get() const;
+    void Reset();
+  };
+  enum class LatencyKind : uint8_t {
+    /* Select and Poller waits */
+    WAIT,
+    /* send and receive system calls (one per batch, for batched calls) */
+    SEND, RECEIVE
+  };
+  /*
+    Optional histograms of how long waits and system calls take. They're
+    off to begin with, since they need two clock readings per call.
+    Bucket 0 counts calls that took no measurable time; bucket n counts
+    calls that took at least 2^(n-1) and less than 2^n nanoseconds.
+  */
+  struct LatencyHistogram {
+    static const int BUCKETS = 48;
+    uint64_t buckets[BUCKETS];
+    uint64_t GetCount() const;
+    /* an upper bound for the given fraction (0 to 1) of calls, in
+       nanoseconds; GetPercentile(0.99) is the 99th percentile */
+    uint64_t GetPercentile(double fraction) const;
+    static LatencyHistogram GetGlobal(LatencyKind kind);
+    static void SetEnabled(bool enabled);
+    static inline bool IsEnabled()
+    { return enabled.load(std::memory_order_relaxed); }
+    /* steady clock, in nanoseconds */
+    static uint64_t Now();
+  private:
+    static std::atomic<bool> enabled;
+  };
+  /* for netsock.cc; start_ns is 0 if the call wasn't timed */
+  void CountIO(SockStats* stats, bool send, IOResult result,
+               uint64_t bytes, uint64_t packets, uint64_t start_ns);
+  void CountInterrupted(SockStats* stats);
+  void CountWait(uint64_t start_ns, bool woke);
+}
+
+#endif
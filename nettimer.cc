@@ -0,0 +1,226 @@
+#include "nettimer.hh"
+
+#include <chrono>
+
+using namespace Net;
+
+/* levels for Timers that aren't in the wheel proper */
+#define LEVEL_RUNNING 0xFF
+#define LEVEL_EXPIRED 0xFE
+
+/* link is the first member of Timer */
+#define timer_of(p) (*reinterpret_cast<Timer*>(p))
+
+Timer::Timer() : wheel(nullptr) {
+  link.prev = link.next = nullptr;
+}
+
+Timer::Timer(std::function<void()> callback)
+  : wheel(nullptr), callback(std::move(callback)) {
+  link.prev = link.next = nullptr;
+}
+
+Timer::~Timer() {
+  Cancel();
+}
+
+void Timer::Cancel() {
+  if(wheel) wheel->Unlink(*this);
+}
+
+TimerWheel::TimerWheel(uint64_t tick_us, uint64_t now_us)
+  : tick_us(tick_us), current(now_us / tick_us), count(0) {
+  assert(tick_us > 0);
+  expired.prev = expired.next = &expired;
+  for(int level = 0; level < LEVELS; ++level) {
+    occupied[level] = 0;
+    for(int slot = 0; slot < SLOTS; ++slot)
+      slots[level][slot].prev = slots[level][slot].next = &slots[level][slot];
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  while(expired.next != &expired) Unlink(timer_of(expired.next));
+  for(int level = 0; level < LEVELS; ++level) {
+    for(int slot = 0; slot < SLOTS; ++slot) {
+      Timer::Link& head = slots[level][slot];
+      while(head.next != &head)
+        Unlink(timer_of(head.next));
+    }
+  }
+}
+
+uint64_t TimerWheel::Now() {
+  return std::chrono::duration_cast<std::chrono::microseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TimerWheel::Insert(Timer& timer) {
+  if(timer.expiry < current) {
+    timer.link.prev = expired.prev;
+    timer.link.next = &expired;
+    expired.prev->next = &timer.link;
+    expired.prev = &timer.link;
+    timer.level = LEVEL_EXPIRED;
+    return;
+  }
+  uint64_t delta = timer.expiry - current;
+  uint64_t when = timer.expiry;
+  int level = 0;
+  while(level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1))))
+    ++level;
+  /* beyond the end of the wheel; park it as far out as we can, and it'll
+     be put back where it belongs when that slot cascades */
+  if(delta >= (1ULL << (SLOT_BITS * LEVELS)))
+    when = current + (1ULL << (SLOT_BITS * LEVELS)) - 1;
+  int slot = (when >> (SLOT_BITS * level)) & (SLOTS - 1);
+  Timer::Link& head = slots[level][slot];
+  timer.link.prev = head.prev;
+  timer.link.next = &head;
+  head.prev->next = &timer.link;
+  head.prev = &timer.link;
+  timer.level = level;
+  timer.slot = slot;
+  occupied[level] |= 1ULL << slot;
+}
+
+void TimerWheel::Unlink(Timer& timer) {
+  assert(timer.wheel == this);
+  timer.link.prev->next = timer.link.next;
+  timer.link.next->prev = timer.link.prev;
+  if(timer.level < LEVELS) {
+    Timer::Link& head = slots[timer.level][timer.slot];
+    if(head.next == &head) occupied[timer.level] &= ~(1ULL << timer.slot);
+  }
+  timer.link.prev = timer.link.next = nullptr;
+  timer.wheel = nullptr;
+  --count;
+}
+
+void TimerWheel::Schedule(Timer& timer, uint64_t deadline_us) {
+  timer.Cancel();
+  timer.wheel = this;
+  timer.expiry = (deadline_us + tick_us - 1) / tick_us;
+  ++count;
+  Insert(timer);
+}
+
+void TimerWheel::Cascade(int level) {
+  int slot = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+  Timer::Link& head = slots[level][slot];
+  if(head.next == &head) return;
+  Timer::Link list = head;
+  list.next->prev = &list;
+  list.prev->next = &list;
+  head.prev = head.next = &head;
+  occupied[level] &= ~(1ULL << slot);
+  while(list.next != &list) {
+    Timer& timer = timer_of(list.next);
+    list.next = timer.link.next;
+    list.next->prev = &list;
+    Insert(timer);
+  }
+}
+
+size_t TimerWheel::Advance(uint64_t now_us) {
+  uint64_t target = now_us / tick_us;
+  size_t ret = 0;
+  /* only the ones that were there when we started */
+  if(expired.next != &expired) ret += Run(expired);
+  while(current <= target) {
+    if(count == 0) {
+      current = target + 1;
+      break;
+    }
+    int index = current & (SLOTS - 1);
+    if(index == 0) {
+      for(int level = 1; level < LEVELS; ++level) {
+        Cascade(level);
+        if((current >> (SLOT_BITS * level)) & (SLOTS - 1)) break;
+      }
+    }
+    uint64_t bits = occupied[0] >> index;
+    if(bits == 0) {
+      /* nothing more in this lap of level 0 */
+      uint64_t next_lap = (current | (SLOTS - 1)) + 1;
+      if(next_lap > target) {
+        current = target + 1;
+        break;
+      }
+      current = next_lap;
+      continue;
+    }
+    int skip = __builtin_ctzll(bits);
+    if(current + skip > target) {
+      current = target + 1;
+      break;
+    }
+    current += skip;
+    index += skip;
+    occupied[0] &= ~(1ULL << index);
+    /* anything the callbacks schedule for now goes in the next tick */
+    ++current;
+    ret += Run(slots[0][index]);
+  }
+  return ret;
+}
+
+size_t TimerWheel::Run(Timer::Link& head) {
+  Timer::Link list = head;
+  list.next->prev = &list;
+  list.prev->next = &list;
+  head.prev = head.next = &head;
+  for(Timer::Link* p = list.next; p != &list; p = p->next)
+    timer_of(p).level = LEVEL_RUNNING;
+  size_t ret = 0;
+  while(list.next != &list) {
+    Timer& timer = timer_of(list.next);
+    Unlink(timer);
+    ++ret;
+    if(timer.callback) timer.callback();
+  }
+  return ret;
+}
+
+uint64_t TimerWheel::GetNextDeadline() const {
+  if(count == 0) return ~(uint64_t)0;
+  if(expired.next != &expired) return 0;
+  uint64_t ret = ~(uint64_t)0;
+  int index = current & (SLOTS - 1);
+  if(occupied[0]) {
+    uint64_t bits = occupied[0] >> index;
+    if(bits) ret = current + __builtin_ctzll(bits);
+    else ret = (current | (SLOTS - 1)) + 1 + __builtin_ctzll(occupied[0]);
+  }
+  for(int level = 1; level < LEVELS; ++level) {
+    if(!occupied[level]) continue;
+    int shift = SLOT_BITS * level;
+    uint64_t base = current >> shift;
+    int cur_slot = base & (SLOTS - 1);
+    /* is this level's current slot still due to cascade at current? */
+    bool pending = (current & ((1ULL << shift) - 1)) == 0;
+    for(int d = pending ? 0 : 1; d <= SLOTS; ++d) {
+      if(occupied[level] & (1ULL << ((cur_slot + d) & (SLOTS - 1)))) {
+        uint64_t when = (base + d) << shift;
+        if(when < ret) ret = when;
+        break;
+      }
+    }
+  }
+  return ret * tick_us;
+}
+
+size_t TimerWheel::GetTimeout(uint64_t now_us, size_t max_timeout_us) const {
+  uint64_t deadline = GetNextDeadline();
+  if(deadline <= now_us) return 0;
+  uint64_t ret = deadline - now_us;
+  return ret < max_timeout_us ? ret : max_timeout_us;
+}
+
+const std::vector<Poller::Event>& TimerWheel::Wait(Poller& poller,
+                                                   size_t max_timeout_us) {
+  const std::vector<Poller::Event>& ret
+    = poller.Wait(GetTimeout(Now(), max_timeout_us));
+  Advance(Now());
+  return ret;
+}
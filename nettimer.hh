@@ -0,0 +1,98 @@
+#ifndef NETTIMERHH
+#define NETTIMERHH
+
+#include "netsock.hh"
+
+#include <functional>
+
+namespace Net {
+  class TimerWheel;
+  /*
+    A callback to be run at a given time by a TimerWheel. The Timer belongs
+    to you, not the wheel; scheduling and canceling are O(1) and never
+    allocate. Destroying a scheduled Timer cancels it.
+  */
+  class Timer {
+    friend class TimerWheel;
+    struct Link {
+      Link* prev, *next;
+    };
+    Link link;
+    TimerWheel* wheel;
+    /* in ticks */
+    uint64_t expiry;
+    uint8_t level, slot;
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+  public:
+    std::function<void()> callback;
+    Timer();
+    explicit Timer(std::function<void()> callback);
+    ~Timer();
+    inline bool IsScheduled() const { return wheel != nullptr; }
+    /* safe to call on a Timer that isn't scheduled */
+    void Cancel();
+  };
+  /*
+    A hierarchical timing wheel (six levels of 64 slots), for thousands of
+    keepalives, resends and timeouts that mostly never fire. Timers are
+    rounded up to the next tick, so they never fire early. Time is in
+    microseconds, from any monotonic clock, as long as it's always the same
+    one; Now() is a good choice, and the one Wait uses.
+    Advancing over idle time costs one step per 64 ticks, no matter how
+    many Timers are scheduled.
+    Not thread safe.
+  */
+  class TimerWheel {
+    friend class Timer;
+    static const int LEVELS = 6;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    Timer::Link slots[LEVELS][SLOTS];
+    /* Timers that were already due when they were scheduled */
+    Timer::Link expired;
+    /* which slots have anything in them */
+    uint64_t occupied[LEVELS];
+    uint64_t tick_us;
+    /* the next tick to be processed */
+    uint64_t current;
+    size_t count;
+    void Insert(Timer& timer);
+    void Unlink(Timer& timer);
+    void Cascade(int level);
+    size_t Run(Timer::Link& head);
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+  public:
+    explicit TimerWheel(uint64_t tick_us = 1000, uint64_t now_us = Now());
+    ~TimerWheel();
+    /* The current time on a steady clock, in microseconds. */
+    static uint64_t Now();
+    /* Schedules (or reschedules) the Timer to run at deadline_us, or the
+       next time Advance is called if that's in the past. The Timer may
+       belong to another TimerWheel. */
+    void Schedule(Timer& timer, uint64_t deadline_us);
+    /* Runs every Timer that's due by now_us. They're unscheduled before
+       they're run, so it's fine for a callback to reschedule its own Timer,
+       or to schedule or cancel any other. Returns how many were run. */
+    size_t Advance(uint64_t now_us);
+    /* When Advance will next have something to do; ~0 if nothing's
+       scheduled. This is sometimes earlier than any Timer's deadline, when
+       Timers need to be moved to a finer level of the wheel. */
+    uint64_t GetNextDeadline() const;
+    /* How long to wait in a Select or Poller, from now_us, to be back in
+       time for the next deadline. */
+    size_t GetTimeout(uint64_t now_us,
+                      size_t max_timeout_us = ~(size_t)0) const;
+    /* Waits on the Poller until something's ready, the next deadline, or
+       max_timeout_us, whichever's first; then runs whatever Timers are due,
+       and returns the Poller's events. */
+    const std::vector<Poller::Event>& Wait(Poller& poller,
+                                           size_t max_timeout_us
+                                           = ~(size_t)0);
+    inline size_t GetCount() const { return count; }
+    inline uint64_t GetTickLength() const { return tick_us; }
+  };
+}
+
+#endif
@@ -1,5 +1,5 @@
 ifndef TEG_OBJECTS
-TEG_OBJECTS:=obj/teg/config.o obj/teg/io.o obj/teg/miscutil.o obj/teg/video.o obj/teg/xgl.o obj/teg/netsock.o obj/teg/postinit.o obj/teg/main.o
+TEG_OBJECTS:=obj/teg/config.o obj/teg/io.o obj/teg/miscutil.o obj/teg/video.o obj/teg/xgl.o obj/teg/netsock.o obj/teg/netstats.o obj/teg/netresolve.o obj/teg/netchannel.o obj/teg/netpmtu.o obj/teg/netcomplete.o obj/teg/nettimer.o obj/teg/netaccept.o obj/teg/netconnect.o obj/teg/netfile.o obj/teg/netqueue.o obj/teg/netpool.o obj/teg/netlocal.o obj/teg/netshm.o obj/teg/netrecord.o obj/teg/netpace.o obj/teg/postinit.o obj/teg/main.o
 endif
 
 lib/libteg.a: $(TEG_OBJECTS)
@@ -9,3 +9,9 @@ lib/libteg.a: $(TEG_OBJECTS)
 lib/libteg.debug.a: $(patsubst %.o,%.debug.o,$(TEG_OBJECTS))
 	@echo Archiving "$@"...
 	@$(AR) $(ARFLAGS) "$@" $^
+
+# Loopback benchmarks for the net code; not part of libteg.a. Prints one
+# JSON object per line. Run "bin/netbench -q" for a quick pass.
+bin/netbench: obj/teg/netbench.o lib/libteg.a
+	@echo Linking "$@"...
+	@$(CXX) $(LDFLAGS) -o "$@" $^ $(LIBS)